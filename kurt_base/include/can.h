@@ -1,22 +1,153 @@
 #ifndef _CAN_H_
 #define _CAN_H_
 
+#include <string>
+
 #include <net/if.h>
 #include <sys/ioctl.h>
 
 #include <linux/can.h>
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "canlog.h"
+
+// maximum number of frames fetched by a single receive_frames() call
+#define CAN_BATCH_SIZE 32
+// maximum number of IDs passed to set_filter()
+#define CAN_MAX_FILTER 16
+// number of different CAN IDs that can wait for transmission
+#define CAN_TX_SLOTS 8
+// AF_PACKET receive ring: CAN_RING_BLOCKS blocks of CAN_RING_BLOCK_SIZE bytes
+// (about 40 frames each); the kernel hands a partly filled block over after
+// CAN_RING_TIMEOUT ms, which bounds the added receive latency
+#define CAN_RING_BLOCK_SIZE 4096
+#define CAN_RING_BLOCKS     64
+#define CAN_RING_TIMEOUT    1
+// io_uring backend: receive buffers (at most one batch, so an epoll wakeup
+// never leaves frames behind) and sends in flight
+#define CAN_URING_BUFS     CAN_BATCH_SIZE
+#define CAN_URING_BUF_SIZE 64
+#define CAN_URING_TX       16
+
+enum CANBackend
+{
+  CAN_BACKEND_RAW,    // SocketCAN raw socket on interface
+  CAN_BACKEND_PACKET, // receive through an AF_PACKET mmap ring, send as raw
+  CAN_BACKEND_URING,  // raw socket driven by io_uring (needs liburing)
+  CAN_BACKEND_REPLAY  // frames from a session log, sent frames are discarded
+};
+
+// backend for a name ("raw", "packet", "uring"), false for unknown names
+bool can_backend_from_string(const std::string &name, CANBackend *backend);
+
+struct CANConfig
+{
+  CANConfig() :
+    interface("can0"),
+    backend(CAN_BACKEND_RAW),
+    replay_speed(1.0) { }
+
+  std::string interface;
+  CANBackend backend;
+  // session log to replay and its speed (1.0 real time, <= 0 as fast as possible)
+  std::string replay_file;
+  double replay_speed;
+  // if set, all received frames are recorded to this session log
+  std::string record_file;
+};
+
 class CAN
 {
   public:
-    CAN();
+    CAN(const CANConfig &config = CANConfig());
     ~CAN();
 
     bool send_frame(const can_frame *frame);
-    bool receive_frame(can_frame *frame);
+    bool flush();
+    bool drain(int timeout_ms);
+    bool set_periodic_frame(const can_frame *frame, double period);
+    bool stop_periodic_frame(canid_t id);
+    bool tx_pending() const { return tx_count_ > 0; }
+    bool receive_frame(can_frame *frame, double *stamp);
+    int receive_frames(can_frame *frames, double *stamps, size_t max, bool wait = true);
+    bool set_filter(const canid_t *ids, size_t nr);
+
+    // socket that becomes readable on received frames, -1 for the replay
+    // backend, which has nothing to poll
+    int fd() const { return rxsocket_; }
+
+    // queued frames replaced by a newer frame with the same ID
+    unsigned long coalesced_frames() const { return coalesced_; }
+    // frames that could not be queued or were rejected by the socket
+    unsigned long dropped_frames() const { return dropped_; }
 
   private:
+    bool wait_for_frame();
+    bool open_ring();
+    int read_ring(can_frame *frames, double *stamps, size_t max);
+    bool accept(canid_t id) const;
+
+    CANBackend backend_;
     int cansocket_;
+    int rxsocket_;
+    int ifindex_;
+
+    // receive filter, only checked in userspace for the packet and replay
+    // backends
+    canid_t filter_ids_[CAN_MAX_FILTER];
+    size_t filter_nr_;
+    bool filtered_;
+
+    // AF_PACKET socket and its TPACKET_V3 ring (packet backend)
+    int packetsocket_;
+    char *ring_;
+    unsigned int ring_block_;  // block read next
+    unsigned int ring_left_;   // frames left in that block, 0 if not taken yet
+    size_t ring_offset_;       // offset of the next frame in that block
+
+    // broadcast manager socket for kernel timed frames, opened on first use
+    int bcmsocket_;
+    canid_t bcm_ids_[CAN_TX_SLOTS];
+    double bcm_periods_[CAN_TX_SLOTS];
+    size_t bcm_count_;
+
+    CANRecorder recorder_;
+    CANReplay replay_;
+
+    // frames waiting for transmission in FIFO order, at most one per ID
+    can_frame tx_queue_[CAN_TX_SLOTS];
+    size_t tx_count_;
+    // frames handed to the kernel but not yet completed (io_uring backend)
+    size_t tx_inflight_;
+    unsigned long coalesced_, dropped_;
+
+#ifdef HAVE_LIBURING
+    bool open_uring();
+    void uring_arm_receive();
+    void uring_submit();
+    void uring_reap();
+    void uring_requeue(const can_frame &frame);
+    bool uring_flush();
+    int uring_receive(can_frame *frames, double *stamps, size_t max, bool wait);
+
+    io_uring uring_;
+    bool uring_open_;
+    // multishot recvmsg, posted again whenever the kernel ends it
+    msghdr rx_msg_;
+    bool rx_armed_;
+    io_uring_buf_ring *rx_ring_;
+    char rx_buf_[CAN_URING_BUFS][CAN_URING_BUF_SIZE];
+    // completed receives in arrival order: buffer id and length
+    unsigned short rx_bid_[CAN_URING_BUFS];
+    int rx_len_[CAN_URING_BUFS];
+    size_t rx_head_, rx_count_;
+    // frames of the sends in flight, one bit per used slot
+    can_frame tx_buf_[CAN_URING_TX];
+    unsigned int tx_busy_;
+#endif
 };
 
 #endif
@@ -0,0 +1,63 @@
+#ifndef _CANFRAMES_H_
+#define _CANFRAMES_H_
+
+#include <stdint.h>
+
+#include <linux/can.h>
+
+// big endian field of Size bytes starting at byte Offset of the frame data;
+// signed fields are two's complement and get sign extended (e.g. the 16 bit
+// encoder counts)
+template <unsigned Offset, unsigned Size, bool Signed = false>
+struct CANField
+{
+  static_assert(Size >= 1 && Size <= 4, "CANField must have 1 - 4 bytes");
+  static_assert(Offset + Size <= CAN_MAX_DLEN, "CANField exceeds the frame data");
+
+  // first byte after the field
+  static const unsigned end = Offset + Size;
+
+  static int64_t get(const can_frame &frame)
+  {
+    uint64_t raw = 0;
+    for (unsigned i = Offset; i < end; i++)
+      raw = (raw << 8) | frame.data[i];
+    if (Signed && (raw >> (8 * Size - 1)) & 1)
+      return (int64_t)raw - ((int64_t)1 << (8 * Size));
+    return raw;
+  }
+};
+
+template <typename... Fields>
+struct CANLayoutEnd;
+
+template <>
+struct CANLayoutEnd<>
+{
+  static const unsigned value = 0;
+};
+
+template <typename Field, typename... Fields>
+struct CANLayoutEnd<Field, Fields...>
+{
+  static const unsigned value = Field::end > CANLayoutEnd<Fields...>::value ?
+    Field::end : CANLayoutEnd<Fields...>::value;
+};
+
+// all fields of the frames with one CAN ID, decoded in the given order
+template <typename... Fields>
+struct CANLayout
+{
+  static const unsigned nr = sizeof...(Fields);
+  // data bytes a frame needs to contain all fields
+  static const unsigned min_dlc = CANLayoutEnd<Fields...>::value;
+
+  static void decode(const can_frame &frame, int64_t *values)
+  {
+    const int64_t v[] = { Fields::get(frame)... };
+    for (unsigned i = 0; i < nr; i++)
+      values[i] = v[i];
+  }
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef _CANLOG_H_
+#define _CANLOG_H_
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+
+#include "spsc_ring.h"
+
+// binary CAN session log: one CANLogHeader followed by fixed size records
+// in receive order, all values in host byte order
+#define CANLOG_MAGIC   "KURTCAN1"
+#define CANLOG_VERSION 1
+// records the receive path can queue before the writer thread catches up,
+// about 5 s of bus traffic
+#define CANLOG_QUEUE_SIZE 4096
+// [s] between two runs of the writer thread
+#define CANLOG_WRITE_PERIOD 0.01
+
+struct CANLogHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+struct CANLogRecord
+{
+  uint64_t stamp_ns; // kernel receive time in ns since epoch
+  uint32_t can_id;
+  uint8_t can_dlc;
+  uint8_t pad[3];
+  uint8_t data[8];
+};
+
+// write() only queues the record, a thread of its own writes the file, so
+// the receive path (possibly a real-time thread) never waits for the disk.
+// The writer thread is started by open() with the scheduling of the caller.
+class CANRecorder
+{
+  public:
+    CANRecorder() : file_(NULL), running_(false), failed_(false), dropped_(0) { }
+    ~CANRecorder() { close(); }
+
+    bool open(const std::string &filename);
+    void close();
+    bool is_open() const { return file_ != NULL; }
+    bool write(const can_frame &frame, double stamp);
+
+  private:
+    static void *writer_thread(void *arg);
+    void write_queued();
+
+    FILE *file_;
+    pthread_t writer_;
+    std::atomic<bool> running_;
+    // set by the writer thread after a write error, later records are dropped
+    std::atomic<bool> failed_;
+    // records lost because the queue was full
+    std::atomic<unsigned long> dropped_;
+    SPSCRing<CANLogRecord, CANLOG_QUEUE_SIZE> queue_;
+};
+
+// reads a session log through mmap and hands out the frames paced like
+// they were recorded: in real time (speed 1.0), N times faster (speed N) or
+// as fast as possible (speed <= 0)
+class CANReplay
+{
+  public:
+    CANReplay() : records_(NULL), nr_(0), next_(0), map_(NULL), map_size_(0), speed_(1.0), start_(0.0) { }
+    ~CANReplay() { close(); }
+
+    bool open(const std::string &filename, double speed);
+    void close();
+    bool eof() const { return next_ >= nr_; }
+    int read_frames(can_frame *frames, double *stamps, size_t max, bool wait);
+
+  private:
+    double due(const CANLogRecord &record) const;
+
+    const CANLogRecord *records_;
+    size_t nr_, next_;
+    void *map_;
+    size_t map_size_;
+    double speed_;
+    // monotonic time at which the first record was handed out
+    double start_;
+};
+
+#endif
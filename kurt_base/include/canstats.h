@@ -0,0 +1,88 @@
+#ifndef _CANSTATS_H_
+#define _CANSTATS_H_
+
+#include <cstddef>
+
+#include <linux/can.h>
+
+// IDs below this are counted per ID, all others only as unknown
+#define CAN_STATS_IDS   0x100
+// number of different IDs with own statistics
+#define CAN_STATS_SLOTS 16
+// inter-arrival time histogram: CAN_STATS_BINS bins of CAN_STATS_BIN_WIDTH
+// seconds, the last bin also counts all longer intervals
+#define CAN_STATS_BINS      128
+#define CAN_STATS_BIN_WIDTH 0.00025
+// latency histogram: CAN_LATENCY_BINS bins of CAN_LATENCY_BIN_WIDTH seconds
+#define CAN_LATENCY_BINS      128
+#define CAN_LATENCY_BIN_WIDTH 0.0001
+
+struct CANIdStats
+{
+  canid_t id;
+  unsigned long count;
+  unsigned long errors; // frames the decoder rejected
+  double first_stamp, last_stamp;
+  double min_dt, max_dt, sum_dt;
+  unsigned int hist[CAN_STATS_BINS];
+
+  // frames per s since the first frame
+  double rate() const;
+  double mean_dt() const;
+  double percentile_dt(double p) const;
+};
+
+// distribution of the time from the receive time stamp of a frame to the
+// reaction sent for it
+struct CANLatencyStats
+{
+  unsigned long count;
+  double min, max, sum;
+  unsigned int hist[CAN_LATENCY_BINS];
+
+  void add(double latency);
+  double mean() const;
+  double percentile(double p) const;
+};
+
+// per CAN ID frame counters and inter-arrival histograms; fixed size and
+// allocation free, so it can be updated for every received frame
+class CANStats
+{
+  public:
+    CANStats();
+
+    void frame(canid_t id, double stamp);
+    void error(canid_t id);
+    void unknown() { unknown_++; }
+
+    size_t size() const { return nr_; }
+    const CANIdStats &at(size_t i) const { return stats_[i]; }
+    unsigned long unknown_frames() const { return unknown_; }
+    // frames per s of at(i) since the earlier snapshot last
+    double rate(size_t i, const CANStats &last) const;
+
+    // monotonic time of the snapshot in s, filled in by Kurt::snapshot_stats
+    double stamp;
+
+    // transmit counters, CAN_CONTROL frames sent and left out as unchanged
+    // (micro controller mode), CAN_GETSPEED frames the odometry had to bridge
+    // and gyro samples without fusion, filled in by Kurt::snapshot_stats
+    unsigned long tx_coalesced, tx_dropped;
+    unsigned long control_frames, control_skipped;
+    unsigned long odometry_bridged;
+    unsigned long gyro_disagreements;
+    // speed sample to CAN_CONTROL / motor frame, filled in by Kurt directly
+    CANLatencyStats control_latency;
+
+  private:
+    CANIdStats *slot(canid_t id);
+
+    // slot index + 1 for each ID, 0 if the ID has no slot yet
+    unsigned char slot_of_[CAN_STATS_IDS];
+    CANIdStats stats_[CAN_STATS_SLOTS];
+    size_t nr_;
+    unsigned long unknown_;
+};
+
+#endif
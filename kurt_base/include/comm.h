@@ -1,20 +1,23 @@
 #ifndef _COMM_H_
 #define _COMM_H_
 
+// stamp is the kernel receive time of the CAN frame in seconds since epoch
 class Comm
 {
   public:
     virtual ~Comm() { }
-    virtual void send_odometry(double z, double x, double theta, double v_encoder,
+    virtual void send_odometry(double stamp, double z, double x, double theta, double v_encoder,
         double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right) = 0;
-    virtual void send_sonar_leftBack(int ir_left_back) = 0;
-    virtual void send_sonar_front_usound_leftFront_left(int ir_right_front, int
+    virtual void send_sonar_leftBack(double stamp, int ir_left_back) = 0;
+    virtual void send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int
         usound, int ir_left_front, int ir_left) = 0;
-    virtual void send_sonar_back_rightBack_rightFront(int ir_back, int
+    virtual void send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int
         ir_right_back, int ir_right) = 0;
-    virtual void send_pitch_roll(double pitch, double roll) = 0;
-    virtual void send_gyro(double theta, double sigma) = 0;
-    virtual void send_rotunit(double rot) = 0;
+    virtual void send_pitch_roll(double stamp, double pitch, double roll) = 0;
+    virtual void send_gyro(double stamp, double theta, double sigma) = 0;
+    virtual void send_rotunit(double stamp, double rot) = 0;
+    // forget the state kept across samples, e.g. after the board restarted
+    virtual void reset() { }
 };
 
 #endif
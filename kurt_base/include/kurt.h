@@ -9,7 +9,11 @@
 #include <linux/can.h>
 
 #include "can.h"
+#include "canframes.h"
+#include "canstats.h"
 #include "comm.h"
+#include "normalize.h"
+#include "odometry.h"
 
 //CAN IDs
 #define CAN_CONTROL    0x00000001 // control message
@@ -34,19 +38,59 @@
 #define CAN_BDC12_15   0x00000018 // analog input channels: 12 - 15
 #define CAN_GYRO_MC2   0x0000001E // data from gyro connected to 2nd C167
 
+// received IDs are below this, it is the size of the decoder table
+#define CAN_DECODER_IDS 0x20
+
+// field layouts of the received frames
+typedef CANLayout<CANField<0, 2>, CANField<2, 2>, CANField<4, 2> >
+  ADC00_03Layout; // IR back, IR right back, IR right front
+typedef CANLayout<CANField<0, 2>, CANField<2, 2>, CANField<4, 2>, CANField<6, 2> >
+  ADC04_07Layout; // IR right, ultrasound front, IR left front, IR left
+typedef CANLayout<CANField<2, 2> >
+  ADC08_11Layout; // IR left back
+typedef CANLayout<CANField<0, 2, true>, CANField<2, 2, true> >
+  EncoderLayout;  // ticks left, right since the last frame
+typedef CANLayout<CANField<0, 4, true>, CANField<4, 4, true> >
+  GetSpeedLayout; // accumulated ticks left, right
+typedef CANLayout<CANField<0, 2>, CANField<2, 2> >
+  TiltLayout;     // tilt left/right, front/back
+typedef CANLayout<CANField<0, 4, true>, CANField<4, 4, true> >
+  GyroLayout;     // angle, variance
+typedef CANLayout<CANField<1, 2> >
+  RotunitLayout;  // rotunit angle
+
+// odometry defaults for kurt2 indoor, kurt_countticks -c calibrates them
+#define KURT_WHEEL_PERIMETER    0.379 // [m]
+#define KURT_AXIS_LENGTH        0.28  // [m]
+#define KURT_TURNING_ADAPTATION 0.69
+#define KURT_TICKS_PER_TURN     21950
+
 #define RAW            0          // raw control mode
 #define SPEED_CM       2          // speed (cm/s) control mode
 #define MAX_V_LIST     200
+#define ENCODER_PERIOD 0.01       // [s] nominal interval of CAN_ENCODER frames
+#define GETSPEED_PERIOD 0.01      // [s] nominal interval of CAN_GETSPEED frames
+#define CONTROL_PERIOD 0.01       // [s] interval of CAN_CONTROL frames
+#define CONTROL_DT_MAX 0.1        // [s] longer gaps restart the speed controller
+#define CONTROL_WATCHDOG 0.1      // [s] the C167 stops without CAN_CONTROL for this long
+#define CONTROL_KEEPALIVE 0.05    // [s] default repetition of an unchanged CAN_CONTROL
+#define CONTROL_FALLBACK 1.5      // encoder triggered control: timer takes over
+                                  // after this many ENCODER_PERIOD without a sample
 
-// values from Sharp GP2D12 IR ranger data sheet
-#define IR_MIN         0.10 // [m]
-#define IR_MAX         0.80 // [m]
-#define IR_FOV         0.074859848 // [rad]
+// online adaptation of the speed -> pwm table, see adapt_feedforward()
+#define ADAPT_BINS     20         // speed bins over 0 .. vmax
+#define ADAPT_MAX      100.0      // [pwm] maximum offset from the measured table
+#define ADAPT_STEP     2.0        // [pwm] maximum change of one step
+#define ADAPT_GAIN     0.1        // share of the controller's correction per step
+#define ADAPT_INTERVAL 0.2        // [s] between two steps of one wheel
+#define ADAPT_STEADY   1.0        // [s] of constant setpoint before learning
+#define ADAPT_E_MAX    0.02       // [m/s] maximum speed error in steady state
+#define ADAPT_V_MIN    0.05       // [m/s] slower setpoints are not learned
 
-// values from Baumer UNDK30I6103 ultrasonic data sheet
-#define SONAR_MIN      0.10 // [m]
-#define SONAR_MAX      1.00 // [m]
-#define SONAR_FOV      0.17809294 // [rad]
+// fusion of the gyros on both C167
+#define GYRO_FRESH     0.05       // [s] a gyro silent for longer is left out
+#define GYRO_GATE      5.0        // heading changes disagree beyond this many sigma
+#define GYRO_GATE_MIN  0.0087     // [rad] but at least 0.5 deg
 
 class Kurt
 {
@@ -56,7 +100,9 @@ class Kurt
         double wheel_perimeter,
         double axis_length,
         double turning_adaptation,
-        int ticks_per_turn_of_wheel) :
+        int ticks_per_turn_of_wheel,
+        const CANConfig &can_config = CANConfig()) :
+      can_(can_config),
       comm_(comm),
       wheel_perimeter_(wheel_perimeter),
       axis_length_(axis_length),
@@ -64,24 +110,71 @@ class Kurt
       ticks_per_turn_of_wheel_(ticks_per_turn_of_wheel),
       use_microcontroller_(true),
       use_rotunit_(false),
+      use_getspeed_(false),
+      use_bcm_(false),
+      bcm_active_(false),
+      control_keepalive_(CONTROL_KEEPALIVE),
+      control_sent_(false),
+      control_stamp_(0.0),
+      control_frames_(0),
+      control_skipped_(0),
       nr_v_(1000),
-      leerlauf_adapt_(0),
+      leerlauf_learn_(false),
       v_encoder_left_(0.0),
-      v_encoder_right_(0.0) { }
+      v_encoder_right_(0.0),
+      last_encoder_stamp_(0.0),
+      control_period_(CONTROL_PERIOD),
+      last_control_stamp_(0.0),
+      speed_sample_(false),
+      speed_sample_stamp_(0.0),
+      encoder_odometry_(wheel_perimeter, axis_length, turning_adaptation, ticks_per_turn_of_wheel),
+      getspeed_valid_(false),
+      odometry_bridged_(0),
+      use_gyro_mc2_(false),
+      gyro_started_(false),
+      gyro_theta_(0.0),
+      gyro_disagree_(false),
+      gyro_disagreements_(0)
+    {
+      for (int i = 0; i < ADAPT_BINS; i++)
+        leerlauf_adapt_l_[i] = leerlauf_adapt_r_[i] = 0.0;
+      reset();
+      update_can_filter();
+    }
     ~Kurt();
 
+    void reset();
+
     bool setPWMData(const std::string &speedPwmLeerlaufTable, double feedforward_turn, double ki, double kp);
+    // learn offsets to the speed table while driving, starting from and
+    // saved on destruction to filename
+    bool setFeedForwardAdaptation(const std::string &filename);
+    void setBCM(bool use_bcm) { use_bcm_ = use_bcm; }
+    void setControlKeepalive(double keepalive);
+    void setGetSpeedOdometry(bool use_getspeed);
+    void setGyroFusion(bool use_gyro_mc2);
+    void setControlRate(double rate) { control_period_ = 1.0 / rate; }
 
     int can_motor(int left_pwm,  char left_dir,  char left_brake,
         int right_pwm, char right_dir, char right_brake);
-    void set_wheel_speed(double _v_l_soll, double _v_r_soll, double _AntiWindup);
+    // stamp: monotonic time of this control update in s
+    void set_wheel_speed(double _v_l_soll, double _v_r_soll, double _AntiWindup, double stamp);
+    // a wheel speed sample arrived that no control update has used yet
+    bool speed_sample() const { return speed_sample_; }
     int can_read_fifo();
+    int can_read_fifo_batch(bool wait = true);
+    int can_fd() const { return can_.fd(); }
+    bool can_flush() { return can_.flush(); }
+    bool can_tx_pending() const { return can_.tx_pending(); }
+    const CAN &can() const { return can_; }
+    void snapshot_stats(CANStats *stats) const;
 
     void can_rotunit_send(double speed);
 
   private:
     CAN can_;
     Comm &comm_;
+    CANStats stats_;
 
     //odometry
     double wheel_perimeter_;
@@ -91,6 +184,19 @@ class Kurt
 
     bool use_microcontroller_;
     bool use_rotunit_;
+    // odometry from the accumulated counts of CAN_GETSPEED instead of the
+    // per frame deltas of CAN_ENCODER
+    bool use_getspeed_;
+    // micro controller mode: let the kernel repeat the CAN_CONTROL frame
+    bool use_bcm_;
+    bool bcm_active_;
+    // micro controller mode: CAN_CONTROL goes out when it changes and is
+    // repeated every control_keepalive_ s otherwise
+    double control_keepalive_;
+    bool control_sent_;
+    can_frame control_frame_;
+    double control_stamp_;
+    unsigned long control_frames_, control_skipped_;
 
     //PWM data
     const int nr_v_;
@@ -98,35 +204,127 @@ class Kurt
     int *pwm_v_l_, *pwm_v_r_;
     double kp_l, kp_r; // schnell aenderung folgen
     double ki_l, ki_r; // integrierer relative langsam
-    int leerlauf_adapt_;
+    // learned pwm offsets per speed bin, added to pwm_v_l_ / pwm_v_r_
+    bool leerlauf_learn_;
+    std::string leerlauf_file_;
+    double leerlauf_adapt_l_[ADAPT_BINS], leerlauf_adapt_r_[ADAPT_BINS];
     double feedforward_turn_; // in v = m/s
+
+    // state of the speed controller of one wheel
+    struct WheelControl
+    {
+      WheelControl() { reset(); }
+      void reset();
+
+      double z, last_z;          // stellgroesse
+      double e, last_e;          // regelabweichung e = soll - ist
+      double int_e;              // integral
+      double de;                 // differenzieren
+      double last_v_ist;         // filter fuer gueltige Werte
+      double v_list[MAX_V_LIST]; // glaettung
+      int index;
+      double f_v_ist;
+      // feedforward adaptation: setpoint of the last update and for how
+      // long it and the error have been steady
+      double last_v_soll;
+      double steady;
+    };
+    WheelControl wheel_l_, wheel_r_;
     // speed from encoder in m/s
     double v_encoder_left_, v_encoder_right_;
+    // kernel receive time of the last CAN_ENCODER frame in s
+    double last_encoder_stamp_;
+    // nominal and measured interval of the speed controller updates
+    double control_period_;
+    double last_control_stamp_;
+    // receive time stamp of the newest wheel speed sample and whether it is
+    // still unused, for the control latency statistics
+    bool speed_sample_;
+    double speed_sample_stamp_;
+    // pose integrated from the encoders
+    Odometry encoder_odometry_;
+    // last CAN_GETSPEED counts and frames lost in between them
+    bool getspeed_valid_;
+    uint32_t getspeed_left_, getspeed_right_;
+    double last_getspeed_stamp_;
+    unsigned long odometry_bridged_;
+
+    // one gyro: start up offset, its latest sample and its heading when it
+    // last went into the fused heading
+    struct Gyro
+    {
+      Gyro() : offset_read(0), offset(0.0), delta(0.0), valid(false), pending(false), fused(false) { }
+      int offset_read;
+      double offset, delta;
+      bool valid;
+      double theta, sigma, stamp;
+      // a sample arrived that is not fused yet
+      bool pending;
+      bool fused;
+      double fused_theta;
+    };
+    Gyro gyro_[2];
+    // fuse CAN_GYRO_MC1 and CAN_GYRO_MC2
+    bool use_gyro_mc2_;
+    // fused heading, integrated from the heading changes of both gyros
+    bool gyro_started_;
+    double gyro_theta_;
+    bool gyro_disagree_;
+    unsigned long gyro_disagreements_;
+
+    // IR and ultrasound distances for the raw ADC values
+    SensorTables sensor_tables_;
 
     //motor
     void k_hard_stop(void);
-    void set_wheel_speed1(double v_l, double v_r, int integration_l, int integration_r);
-    void set_wheel_speed2(double _v_l_soll, double _v_r_soll, double _v_l_ist,
-        double _v_r_ist, double _omega, double _AntiWindup);
-    void set_wheel_speed2_mc(double _v_l_soll, double _v_r_soll, double _omega,
-        double _AntiWindup);
-    void odometry(int wheel_a, int wheel_b);
+    bool set_wheel_speed1(double v_l, double v_r, int integration_l, int integration_r);
+    int feedforward(const int *pwm_v, const double *adapt, double v) const;
+    void adapt_feedforward(WheelControl &w, double *adapt, const int *pwm_v,
+        double v_soll, double z, double dt);
+    bool load_feedforward_adaptation(const std::string &filename);
+    bool save_feedforward_adaptation(const std::string &filename) const;
+    double control_wheel(WheelControl &w, double v_soll, double v_ist,
+        double kp, double ki, double feedforward, double AntiWindup, double dt);
+    bool set_wheel_speed2(double _v_l_soll, double _v_r_soll, double _v_l_ist,
+        double _v_r_ist, double _omega, double _AntiWindup, double dt);
+    bool set_wheel_speed2_mc(double _v_l_soll, double _v_r_soll, double _omega,
+        double _AntiWindup, double stamp);
+    void odometry(double stamp, double dt, int wheel_a, int wheel_b);
     bool read_speed_to_pwm_leerlauf_tabelle(const std::string &filename, int *nr,
         double **v_pwm_l, double **v_pwm_r);
     void make_pwm_v_tab(int nr, double *v_pwm_l, double *v_pwm_r, int nr_v, int
         **pwm_v_l, int **pwm_v_r, double *v_max);
 
-    //sensors
-    void can_encoder(const can_frame &frame);
-    int normalize_ir(int ir);
-    int normalize_sonar(int s);
-    void can_sonar8_9(const can_frame &frame);
-    void can_sonar4_7(const can_frame &frame);
-    void can_sonar0_3(const can_frame &frame);
-    void can_tilt_comp(const can_frame &frame);
-    void can_gyro_mc1(const can_frame &frame);
-
-    void can_rotunit(const can_frame &frame);
+    //sensors, called with the fields of their frame layout
+    void can_encoder(const int64_t *v, double stamp);
+    void can_getspeed(const int64_t *v, double stamp);
+    void can_sonar8_9(const int64_t *v, double stamp);
+    void can_sonar4_7(const int64_t *v, double stamp);
+    void can_sonar0_3(const int64_t *v, double stamp);
+    void can_tilt_comp(const int64_t *v, double stamp);
+    void can_gyro_mc1(const int64_t *v, double stamp);
+    void can_gyro_mc2(const int64_t *v, double stamp);
+    bool gyro_update(Gyro &gyro, const int64_t *v, double stamp);
+    double gyro_step(Gyro &gyro);
+    void gyro_fuse(double stamp);
+
+    void can_rotunit(const int64_t *v, double stamp);
+
+    typedef void (Kurt::*Decoder)(const can_frame &frame, double stamp);
+    struct DecoderEntry
+    {
+      unsigned char min_dlc;
+      Decoder decode; // NULL for IDs that are not decoded
+    };
+    // decoders indexed by CAN ID
+    static const DecoderEntry decoders_[CAN_DECODER_IDS];
+
+    // decodes the fields of Layout and passes them to Handler
+    template <typename Layout, void (Kurt::*Handler)(const int64_t *v, double stamp)>
+    void decode(const can_frame &frame, double stamp);
+
+    void can_dispatch(const can_frame &frame, double stamp);
+    void update_can_filter();
 };
 
 #endif
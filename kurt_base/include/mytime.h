@@ -1,15 +1,44 @@
 #ifndef _mytime_
 #define _mytime_
 
-#define NR_TIMER 10
-// timer 0 is for local use
-// wheel encoder use timer 1
+#include <stdint.h>
 
+// Zeitmessung fuer die Kalibrier-Programme, alles auf CLOCK_MONOTONIC
+// (springt nicht mit NTP) und in ns
 
-long double   Get_mtime_diff(int timer_number);
-unsigned long GetCurrentTimeInMilliSec(void);
-void          mydelay (unsigned long msec);
+#define MYTIME_MS(ms) ((int64_t)(ms) * 1000000)
 
+// monotonic time in ns
+int64_t mytime_now(void);
 
+// stop watch
+struct MyTimer
+{
+  int64_t start;
+};
+
+void        mytime_start(MyTimer *timer);
+long double mytime_elapsed_ms(const MyTimer *timer);
+
+// periodic deadlines without drift: deadline n is start + n * period, no
+// matter how late the ones before were served. Deadlines that passed while
+// a cycle was still running are skipped and counted in overruns.
+struct MyPeriodic
+{
+  int64_t period;         // [ns]
+  int64_t next;           // next deadline
+  unsigned long cycles;
+  unsigned long overruns;
+};
+
+void mytime_periodic_start(MyPeriodic *periodic, int64_t period);
+// sleeps until the next deadline
+void mytime_periodic_wait(MyPeriodic *periodic);
+// for loops that block elsewhere (e.g. on CAN frames): true once per
+// deadline that has passed, without sleeping
+bool mytime_periodic_due(MyPeriodic *periodic);
+
+// warten ohne CPU last
+void mydelay(unsigned long msec);
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef _NORMALIZE_H_
+#define _NORMALIZE_H_
+
+#include <stdint.h>
+
+// values from Sharp GP2D12 IR ranger data sheet
+#define IR_MIN         0.10 // [m]
+#define IR_MAX         0.80 // [m]
+#define IR_FOV         0.074859848 // [rad]
+
+// values from Baumer UNDK30I6103 ultrasonic data sheet
+#define SONAR_MIN      0.10 // [m]
+#define SONAR_MAX      1.00 // [m]
+#define SONAR_FOV      0.17809294 // [rad]
+
+// raw ADC values with a valid IR / sonar reading, values outside give -1
+#define IR_RAW_MIN     ((int)(IR_MIN * 1000))
+#define IR_RAW_MAX     ((int)(IR_MAX * 1000))
+#define SONAR_RAW_MIN  ((int)(SONAR_MIN * 1000))
+#define SONAR_RAW_MAX  ((int)(SONAR_MAX * 1000))
+
+#define IR_TABLE_SIZE    (IR_RAW_MAX - IR_RAW_MIN + 1)
+#define SONAR_TABLE_SIZE (SONAR_RAW_MAX - SONAR_RAW_MIN + 1)
+
+// channels of an ADC frame
+enum SensorChannel
+{
+  SENSOR_IR,
+  SENSOR_SONAR
+};
+
+// distance in mm for a raw ADC value of the IR and ultrasound rangers. The
+// curves are evaluated once for every valid raw value, so reading a frame
+// only needs a range check and a load per channel.
+class SensorTables
+{
+  public:
+    SensorTables();
+
+    int ir(int raw) const
+    {
+      unsigned int i = raw - IR_RAW_MIN;
+      return i < IR_TABLE_SIZE ? table_[i] : -1;
+    }
+    int sonar(int raw) const
+    {
+      unsigned int i = raw - SONAR_RAW_MIN;
+      return i < SONAR_TABLE_SIZE ? table_[IR_TABLE_SIZE + i] : -1;
+    }
+
+    // all (at most 4) channels of a frame at once: range checks and table
+    // indices with SSE2 where available, same results as ir() and sonar()
+    void normalize_frame(const int64_t *raw, const SensorChannel *channels, int nr, int *out) const;
+
+  private:
+    // IR entries, then the ultrasound entries
+    short table_[IR_TABLE_SIZE + SONAR_TABLE_SIZE];
+};
+
+#endif
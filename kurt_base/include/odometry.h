@@ -0,0 +1,40 @@
+#ifndef _ODOMETRY_H_
+#define _ODOMETRY_H_
+
+#include <stdint.h>
+
+// pose from the wheel encoders, kept as exact 64 bit tick totals. The
+// heading is a function of the totals alone; the position is the
+// (compensated) sum of the closed form arcs between two consecutive totals,
+// so the same sequence of totals always rebuilds the same pose.
+class Odometry
+{
+  public:
+    Odometry(double wheel_perimeter, double axis_length, double turning_adaptation,
+        int ticks_per_turn_of_wheel);
+
+    void reset();
+    // ticks of both wheels since the last call
+    void add(int64_t ticks_left, int64_t ticks_right);
+    // new tick totals, e.g. from a log
+    void update(int64_t total_left, int64_t total_right);
+
+    int64_t total_left() const { return total_left_; }
+    int64_t total_right() const { return total_right_; }
+    double x() const { return x_; }
+    double z() const { return z_; }
+    // in -pi .. pi
+    double theta() const;
+
+  private:
+    double meter_per_tick_;
+    // heading change per tick of left minus right wheel
+    double rad_per_tick_;
+
+    int64_t total_left_, total_right_;
+    // position and the rounding errors of its sums (Kahan)
+    double x_, z_;
+    double x_error_, z_error_;
+};
+
+#endif
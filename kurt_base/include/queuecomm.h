@@ -0,0 +1,179 @@
+#ifndef _QUEUECOMM_H_
+#define _QUEUECOMM_H_
+
+#include <atomic>
+
+#include "comm.h"
+#include "spsc_ring.h"
+
+// fixed size copy of one Comm call
+struct CommSample
+{
+  enum Type
+  {
+    ODOMETRY,
+    SONAR_LEFT_BACK,
+    SONAR_FRONT,
+    SONAR_BACK,
+    PITCH_ROLL,
+    GYRO,
+    ROTUNIT,
+    RESET
+  };
+
+  Type type;
+  double stamp;
+  double d[7];
+  int i[4];
+};
+
+#define COMM_QUEUE_SIZE 256
+
+// Comm that queues decoded samples for another thread: Kurt runs in the
+// producer thread, forward() replays the samples into the real Comm in the
+// consumer thread
+class QueueComm : public Comm
+{
+  public:
+    QueueComm() : dropped_(0) { }
+
+    void send_odometry(double stamp, double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right)
+    {
+      CommSample s;
+      s.type = CommSample::ODOMETRY;
+      s.stamp = stamp;
+      s.d[0] = z;
+      s.d[1] = x;
+      s.d[2] = theta;
+      s.d[3] = v_encoder;
+      s.d[4] = v_encoder_angular;
+      s.d[5] = v_encoder_left;
+      s.d[6] = v_encoder_right;
+      s.i[0] = wheel_a;
+      s.i[1] = wheel_b;
+      push(s);
+    }
+
+    void send_sonar_leftBack(double stamp, int ir_left_back)
+    {
+      CommSample s;
+      s.type = CommSample::SONAR_LEFT_BACK;
+      s.stamp = stamp;
+      s.i[0] = ir_left_back;
+      push(s);
+    }
+
+    void send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int usound, int ir_left_front, int ir_left)
+    {
+      CommSample s;
+      s.type = CommSample::SONAR_FRONT;
+      s.stamp = stamp;
+      s.i[0] = ir_right_front;
+      s.i[1] = usound;
+      s.i[2] = ir_left_front;
+      s.i[3] = ir_left;
+      push(s);
+    }
+
+    void send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int ir_right_back, int ir_right)
+    {
+      CommSample s;
+      s.type = CommSample::SONAR_BACK;
+      s.stamp = stamp;
+      s.i[0] = ir_back;
+      s.i[1] = ir_right_back;
+      s.i[2] = ir_right;
+      push(s);
+    }
+
+    void send_pitch_roll(double stamp, double pitch, double roll)
+    {
+      CommSample s;
+      s.type = CommSample::PITCH_ROLL;
+      s.stamp = stamp;
+      s.d[0] = pitch;
+      s.d[1] = roll;
+      push(s);
+    }
+
+    void send_gyro(double stamp, double theta, double sigma)
+    {
+      CommSample s;
+      s.type = CommSample::GYRO;
+      s.stamp = stamp;
+      s.d[0] = theta;
+      s.d[1] = sigma;
+      push(s);
+    }
+
+    void send_rotunit(double stamp, double rot)
+    {
+      CommSample s;
+      s.type = CommSample::ROTUNIT;
+      s.stamp = stamp;
+      s.d[0] = rot;
+      push(s);
+    }
+
+    void reset()
+    {
+      CommSample s;
+      s.type = CommSample::RESET;
+      s.stamp = 0.0;
+      push(s);
+    }
+
+    // consumer side: hands all queued samples to comm
+    void forward(Comm &comm)
+    {
+      CommSample s;
+      while (ring_.pop(s))
+      {
+        switch (s.type)
+        {
+          case CommSample::ODOMETRY:
+            comm.send_odometry(s.stamp, s.d[0], s.d[1], s.d[2], s.d[3], s.d[4], s.i[0], s.i[1], s.d[5], s.d[6]);
+            break;
+          case CommSample::SONAR_LEFT_BACK:
+            comm.send_sonar_leftBack(s.stamp, s.i[0]);
+            break;
+          case CommSample::SONAR_FRONT:
+            comm.send_sonar_front_usound_leftFront_left(s.stamp, s.i[0], s.i[1], s.i[2], s.i[3]);
+            break;
+          case CommSample::SONAR_BACK:
+            comm.send_sonar_back_rightBack_rightFront(s.stamp, s.i[0], s.i[1], s.i[2]);
+            break;
+          case CommSample::PITCH_ROLL:
+            comm.send_pitch_roll(s.stamp, s.d[0], s.d[1]);
+            break;
+          case CommSample::GYRO:
+            comm.send_gyro(s.stamp, s.d[0], s.d[1]);
+            break;
+          case CommSample::ROTUNIT:
+            comm.send_rotunit(s.stamp, s.d[0]);
+            break;
+          case CommSample::RESET:
+            comm.reset();
+            break;
+        }
+      }
+    }
+
+    // samples lost because the consumer fell behind
+    unsigned long dropped() const
+    {
+      return dropped_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    void push(const CommSample &s)
+    {
+      if (!ring_.push(s))
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    SPSCRing<CommSample, COMM_QUEUE_SIZE> ring_;
+    std::atomic<unsigned long> dropped_;
+};
+
+#endif
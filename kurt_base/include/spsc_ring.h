@@ -0,0 +1,47 @@
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+
+// wait-free ring buffer for exactly one producer and one consumer thread;
+// N must be a power of two, one slot is always kept free
+template <typename T, size_t N>
+class SPSCRing
+{
+  public:
+    SPSCRing() : head_(0), tail_(0) { }
+
+    // producer side, returns false if the ring is full
+    bool push(const T &item)
+    {
+      size_t head = head_.load(std::memory_order_relaxed);
+      size_t next = (head + 1) & (N - 1);
+      if (next == tail_.load(std::memory_order_acquire))
+        return false;
+      buffer_[head] = item;
+      head_.store(next, std::memory_order_release);
+      return true;
+    }
+
+    // consumer side, returns false if the ring is empty
+    bool pop(T &item)
+    {
+      size_t tail = tail_.load(std::memory_order_relaxed);
+      if (tail == head_.load(std::memory_order_acquire))
+        return false;
+      item = buffer_[tail];
+      tail_.store((tail + 1) & (N - 1), std::memory_order_release);
+      return true;
+    }
+
+  private:
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SPSCRing size must be a power of two");
+
+    T buffer_[N];
+    // producer and consumer indices on separate cache lines
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef _STDOUTCOMM_H_
 #define _STDOUTCOMM_H_
 
+#include <cmath>
 #include <iostream>
 
 #include "comm.h"
@@ -8,8 +9,8 @@
 class STDoutComm : public Comm
 {
   public:
-    STDoutComm() : sum_ticks_a_(0), sum_ticks_b_(0) { }
-    void send_odometry(double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right)
+    STDoutComm() : sum_ticks_a_(0), sum_ticks_b_(0), gyro_nr_(0), gyro_theta_(0.0), gyro_sum_(0.0) { }
+    void send_odometry(double stamp, double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right)
     {
       std::cout << "Odometry: z: " << z << " x: " << x << " theta: " << theta << std::endl;
       std::cout << "Encoder: wheel_a: " << wheel_a  << " wheel_b: " << wheel_b << std::endl;
@@ -22,12 +23,12 @@ class STDoutComm : public Comm
       v_encoder_right_ = v_encoder_right;
     }
 
-    void send_sonar_leftBack(int ir_left_back)
+    void send_sonar_leftBack(double stamp, int ir_left_back)
     {
       std::cout << "IR left back: " << ir_left_back << std::endl;
     }
 
-    void send_sonar_front_usound_leftFront_left(int ir_right_front, int usound, int ir_left_front, int ir_left)
+    void send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int usound, int ir_left_front, int ir_left)
     {
       std::cout << "IR right front: " << ir_right_front << std::endl;
       std::cout << "ultrasound front: " << usound << std::endl;
@@ -35,24 +36,30 @@ class STDoutComm : public Comm
       std::cout << "IR left: " << ir_left << std::endl;
     }
 
-    void send_sonar_back_rightBack_rightFront(int ir_back, int ir_right_back, int ir_right)
+    void send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int ir_right_back, int ir_right)
     {
       std::cout << "IR back: " << ir_back << std::endl;
       std::cout << "IR right back: " << ir_right_back << std::endl;
       std::cout << "IR right: " << ir_right << std::endl;
     }
 
-    void send_pitch_roll(double pitch, double roll)
+    void send_pitch_roll(double stamp, double pitch, double roll)
     {
       std::cout << "pitch: " << pitch << " roll: " << roll << std::endl;
     }
 
-    void send_gyro(double theta, double sigma)
+    void send_gyro(double stamp, double theta, double sigma)
     {
       std::cout << "Gyro: theta: " << theta << " sigma: " << sigma << std::endl;
+
+      // heading without the jumps at +-pi
+      if (gyro_nr_ > 0)
+        gyro_sum_ += remainder(theta - gyro_theta_, 2.0 * M_PI);
+      gyro_theta_ = theta;
+      gyro_nr_++;
     }
 
-    void send_rotunit(double rot)
+    void send_rotunit(double stamp, double rot)
     {
       std::cout << "Rotunit" << rot <<  std::endl;
     }
@@ -82,11 +89,24 @@ class STDoutComm : public Comm
       return v_encoder_right_;
     }
 
+    // gyro samples received and the heading turned since the first one
+    unsigned long gyro_nr()
+    {
+      return gyro_nr_;
+    }
+
+    double gyro_sum()
+    {
+      return gyro_sum_;
+    }
+
   private:
     unsigned long long sum_ticks_a_;
     unsigned long long sum_ticks_b_;
     double v_encoder_;
     double v_encoder_left_, v_encoder_right_;
+    unsigned long gyro_nr_;
+    double gyro_theta_, gyro_sum_;
 };
 
 #endif
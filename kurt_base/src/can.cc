@@ -1,23 +1,68 @@
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <arpa/inet.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 
+#include <linux/can/bcm.h>
 #include <linux/can/raw.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
 
 #include <ros/console.h>
 
 #include "can.h"
 
-CAN::CAN()
+CAN::CAN(const CANConfig &config) :
+  backend_(config.backend),
+  cansocket_(-1),
+  rxsocket_(-1),
+  ifindex_(0),
+  filter_nr_(0),
+  filtered_(false),
+  packetsocket_(-1),
+  ring_(NULL),
+  ring_block_(0),
+  ring_left_(0),
+  ring_offset_(0),
+  bcmsocket_(-1),
+  bcm_count_(0),
+  tx_count_(0),
+  tx_inflight_(0),
+  coalesced_(0),
+  dropped_(0)
+#ifdef HAVE_LIBURING
+  ,
+  uring_open_(false),
+  rx_armed_(false),
+  rx_ring_(NULL),
+  rx_head_(0),
+  rx_count_(0),
+  tx_busy_(0)
+#endif
 {
+  if (!config.record_file.empty() && !recorder_.open(config.record_file))
+    exit(1);
+
+  if (backend_ == CAN_BACKEND_REPLAY)
+  {
+    if (!replay_.open(config.replay_file, config.replay_speed))
+      exit(1);
+    return;
+  }
+
   sockaddr_can addr;
   ifreq ifr;
-  char caninterface[] = "can0"; //TODO automatic searching for caninterface
+  const char *caninterface = config.interface.c_str();
 
   cansocket_ = socket(PF_CAN, SOCK_RAW, CAN_RAW);
   if (cansocket_ < 0) {
@@ -27,44 +72,375 @@ CAN::CAN()
 
   addr.can_family = AF_CAN;
 
+  if (config.interface.size() >= sizeof(ifr.ifr_name)) {
+    ROS_ERROR("can_init: Interface name %s too long", caninterface);
+    exit(1);
+  }
   strcpy(ifr.ifr_name, caninterface);
   if (ioctl(cansocket_, SIOCGIFINDEX, &ifr) < 0) {
     ROS_ERROR("can_init: Error setting SIOCGIFINDEX for interace %s (%s)", caninterface, strerror(errno));
     exit(1);
   }
 
-  addr.can_ifindex = ifr.ifr_ifindex;
+  addr.can_ifindex = ifindex_ = ifr.ifr_ifindex;
 
   if (bind(cansocket_, (sockaddr *)&addr, sizeof(addr)) < 0) {
     ROS_ERROR("can_init: Error binding socket (%s)", strerror(errno));
     exit(1);
   }
 
+  // never block in write, a full TX queue is handled by flush(); io_uring
+  // needs a blocking socket to wait for frames without failing with EAGAIN
+  if (backend_ != CAN_BACKEND_URING &&
+      fcntl(cansocket_, F_SETFL, fcntl(cansocket_, F_GETFL) | O_NONBLOCK) < 0) {
+    ROS_ERROR("can_init: Error setting O_NONBLOCK (%s)", strerror(errno));
+    exit(1);
+  }
+
+  // let the kernel stamp every frame on arrival
+  int enable = 1;
+  if (setsockopt(cansocket_, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+    ROS_WARN("can_init: Error enabling SO_TIMESTAMPNS (%s), using receive time", strerror(errno));
+  }
+
+  rxsocket_ = cansocket_;
+  if (backend_ == CAN_BACKEND_PACKET)
+  {
+    // the raw socket only sends, so it must not queue received frames
+    if (setsockopt(cansocket_, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0) < 0) {
+      ROS_ERROR("can_init: Error clearing CAN_RAW_FILTER (%s)", strerror(errno));
+      exit(1);
+    }
+    if (!open_ring())
+      exit(1);
+    rxsocket_ = packetsocket_;
+  }
+  else if (backend_ == CAN_BACKEND_URING)
+  {
+#ifdef HAVE_LIBURING
+    if (!open_uring())
+      exit(1);
+    // the ring fd becomes readable when completions are waiting
+    rxsocket_ = uring_.ring_fd;
+#else
+    ROS_ERROR("can_init: Built without liburing, the uring backend is not available");
+    exit(1);
+#endif
+  }
+
   ROS_INFO("CAN interface init done");
 }
 
+bool can_backend_from_string(const std::string &name, CANBackend *backend)
+{
+  if (name == "raw")
+    *backend = CAN_BACKEND_RAW;
+  else if (name == "packet")
+    *backend = CAN_BACKEND_PACKET;
+  else if (name == "uring")
+    *backend = CAN_BACKEND_URING;
+  else
+    return false;
+  return true;
+}
+
+// opens an AF_PACKET socket for classic CAN frames on the interface and
+// maps its TPACKET_V3 receive ring; the kernel writes the frames directly
+// into the shared ring, so reading them needs no syscall
+bool CAN::open_ring()
+{
+  packetsocket_ = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_CAN));
+  if (packetsocket_ < 0) {
+    ROS_ERROR("can_init: Error opening packet socket (%s)", strerror(errno));
+    return false;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(packetsocket_, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+    ROS_ERROR("can_init: Error setting TPACKET_V3 (%s)", strerror(errno));
+    return false;
+  }
+
+  tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = CAN_RING_BLOCK_SIZE;
+  req.tp_block_nr = CAN_RING_BLOCKS;
+  // frames are packed into the blocks, the frame size is only checked
+  req.tp_frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + sizeof(can_frame));
+  req.tp_frame_nr = CAN_RING_BLOCK_SIZE / req.tp_frame_size * CAN_RING_BLOCKS;
+  req.tp_retire_blk_tov = CAN_RING_TIMEOUT;
+  if (setsockopt(packetsocket_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    ROS_ERROR("can_init: Error setting PACKET_RX_RING (%s)", strerror(errno));
+    return false;
+  }
+
+  void *ring = mmap(NULL, (size_t)CAN_RING_BLOCK_SIZE * CAN_RING_BLOCKS,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, packetsocket_, 0);
+  if (ring == MAP_FAILED) {
+    ROS_ERROR("can_init: Error mapping receive ring (%s)", strerror(errno));
+    return false;
+  }
+  ring_ = (char *)ring;
+
+  sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_CAN);
+  addr.sll_ifindex = ifindex_;
+  if (bind(packetsocket_, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    ROS_ERROR("can_init: Error binding packet socket (%s)", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
 CAN::~CAN()
 {
-  if (close(cansocket_) != 0)
+  if (coalesced_ > 0 || dropped_ > 0)
+    ROS_INFO("can_close: %lu frames coalesced, %lu frames dropped", coalesced_, dropped_);
+#ifdef HAVE_LIBURING
+  if (rx_ring_ != NULL)
+    io_uring_free_buf_ring(&uring_, rx_ring_, CAN_URING_BUFS, 0);
+  if (uring_open_)
+    io_uring_queue_exit(&uring_);
+#endif
+  if (ring_ != NULL)
+    munmap(ring_, (size_t)CAN_RING_BLOCK_SIZE * CAN_RING_BLOCKS);
+  if (packetsocket_ >= 0 && close(packetsocket_) != 0)
+    ROS_ERROR("can_close: Error closing packet socket (%s)", strerror(errno));
+  if (bcmsocket_ >= 0 && close(bcmsocket_) != 0)
+    ROS_ERROR("can_close: Error closing bcm socket (%s)", strerror(errno));
+  if (cansocket_ >= 0 && close(cansocket_) != 0)
     ROS_ERROR("can_close: Error closing can socket (%s)", strerror(errno));
 }
 
+// queues the frame and tries to send the queue; an unsent frame with the
+// same ID is replaced, so only the latest setpoint goes out
 bool CAN::send_frame(const can_frame *frame)
 {
-  if (write(cansocket_, frame, sizeof(*frame)) != sizeof(*frame))
+  if (backend_ == CAN_BACKEND_REPLAY)
+    return true;
+
+  size_t i;
+  for (i = 0; i < tx_count_; i++)
+  {
+    if (tx_queue_[i].can_id == frame->can_id)
+    {
+      tx_queue_[i] = *frame;
+      coalesced_++;
+      break;
+    }
+  }
+
+  if (i == tx_count_)
+  {
+    if (tx_count_ == CAN_TX_SLOTS)
+    {
+      ROS_ERROR("send_frame: TX queue full, dropping frame %X", frame->can_id);
+      dropped_++;
+      return false;
+    }
+    tx_queue_[tx_count_++] = *frame;
+  }
+
+  flush();
+  return true;
+}
+
+// sends as many queued frames as the socket takes with a single sendmmsg;
+// returns false if frames are left in the queue
+bool CAN::flush()
+{
+  mmsghdr msgs[CAN_TX_SLOTS];
+  iovec iovs[CAN_TX_SLOTS];
+
+#ifdef HAVE_LIBURING
+  if (backend_ == CAN_BACKEND_URING)
+    return uring_flush();
+#endif
+
+  while (tx_count_ > 0)
+  {
+    memset(msgs, 0, sizeof(msgs[0]) * tx_count_);
+    for (size_t i = 0; i < tx_count_; i++)
+    {
+      iovs[i].iov_base = &tx_queue_[i];
+      iovs[i].iov_len = sizeof(tx_queue_[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int rc = sendmmsg(cansocket_, msgs, tx_count_, MSG_DONTWAIT);
+    if (rc < 0)
+    {
+      // device queue full, retry on the next flush
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        return false;
+
+      ROS_ERROR("send_frame: Error writing socket (%s)", strerror(errno));
+      dropped_++;
+      rc = 1;
+    }
+
+    tx_count_ -= rc;
+    memmove(tx_queue_, tx_queue_ + rc, tx_count_ * sizeof(tx_queue_[0]));
+  }
+  return true;
+}
+
+// flushes until the queue is empty and all sends are completed or
+// timeout_ms passed
+bool CAN::drain(int timeout_ms)
+{
+  for (int i = 0; !flush() || tx_inflight_ > 0; i++)
+  {
+    if (i >= timeout_ms)
+      return false;
+    usleep(1000);
+  }
+  return true;
+}
+
+// bcm message head followed by one frame
+union bcm_tx_msg
+{
+  bcm_msg_head head;
+  char buffer[sizeof(bcm_msg_head) + sizeof(can_frame)];
+};
+
+// lets the kernel send frame every period seconds (SocketCAN broadcast
+// manager). Calling it again for the same ID and period only replaces the
+// data, which is sent at once and then in the running period. The kernel
+// stops sending when the socket is closed, i.e. when the driver exits.
+bool CAN::set_periodic_frame(const can_frame *frame, double period)
+{
+  if (backend_ == CAN_BACKEND_REPLAY)
+    return true;
+
+  if (bcmsocket_ < 0)
+  {
+    bcmsocket_ = socket(PF_CAN, SOCK_DGRAM, CAN_BCM);
+    if (bcmsocket_ < 0)
+    {
+      ROS_ERROR("set_periodic_frame: Error opening bcm socket (%s)", strerror(errno));
+      return false;
+    }
+
+    sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifindex_;
+    if (connect(bcmsocket_, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+      ROS_ERROR("set_periodic_frame: Error connecting bcm socket (%s)", strerror(errno));
+      close(bcmsocket_);
+      bcmsocket_ = -1;
+      return false;
+    }
+  }
+
+  size_t i;
+  for (i = 0; i < bcm_count_ && bcm_ids_[i] != frame->can_id; i++) ;
+  if (i == CAN_TX_SLOTS)
+  {
+    ROS_ERROR("set_periodic_frame: Too many periodic frames");
+    return false;
+  }
+
+  bcm_tx_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.head.opcode = TX_SETUP;
+  msg.head.can_id = frame->can_id;
+  msg.head.flags = TX_ANNOUNCE;
+  msg.head.nframes = 1;
+  memcpy(msg.head.frames, frame, sizeof(*frame));
+
+  // (re)start the timer only for new jobs or a changed period
+  if (i == bcm_count_ || bcm_periods_[i] != period)
+  {
+    msg.head.flags |= SETTIMER | STARTTIMER;
+    msg.head.ival2.tv_sec = (long)period;
+    msg.head.ival2.tv_usec = (long)((period - (long)period) * 1e6);
+  }
+
+  if (write(bcmsocket_, &msg, sizeof(msg)) != sizeof(msg))
+  {
+    ROS_ERROR("set_periodic_frame: Error writing bcm socket (%s)", strerror(errno));
+    return false;
+  }
+
+  bcm_ids_[i] = frame->can_id;
+  bcm_periods_[i] = period;
+  if (i == bcm_count_)
+    bcm_count_++;
+  return true;
+}
+
+bool CAN::stop_periodic_frame(canid_t id)
+{
+  size_t i;
+  for (i = 0; i < bcm_count_ && bcm_ids_[i] != id; i++) ;
+  if (i == bcm_count_)
+    return true;
+
+  bcm_tx_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.head.opcode = TX_DELETE;
+  msg.head.can_id = id;
+
+  bcm_count_--;
+  bcm_ids_[i] = bcm_ids_[bcm_count_];
+  bcm_periods_[i] = bcm_periods_[bcm_count_];
+
+  if (write(bcmsocket_, &msg, sizeof(msg.head)) != sizeof(msg.head))
+  {
+    ROS_ERROR("stop_periodic_frame: Error writing bcm socket (%s)", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// only let the kernel queue standard data frames with the given IDs; the
+// packet socket sees all frames and a replayed log holds all recorded
+// frames, so there the IDs are checked on reading
+bool CAN::set_filter(const canid_t *ids, size_t nr)
+{
+  can_filter filter[CAN_MAX_FILTER];
+
+  if (nr > CAN_MAX_FILTER)
+  {
+    ROS_ERROR("set_filter: Too many CAN IDs (%zu)", nr);
+    return false;
+  }
+
+  if (backend_ == CAN_BACKEND_PACKET || backend_ == CAN_BACKEND_REPLAY)
+  {
+    std::copy(ids, ids + nr, filter_ids_);
+    filter_nr_ = nr;
+    filtered_ = true;
+    return true;
+  }
+
+  for (size_t i = 0; i < nr; i++)
   {
-    ROS_ERROR("send_frame: Error writing socket (%s)", strerror(errno));
+    filter[i].can_id = ids[i];
+    filter[i].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
+  }
+
+  if (setsockopt(cansocket_, SOL_CAN_RAW, CAN_RAW_FILTER, filter, nr * sizeof(filter[0])) < 0)
+  {
+    ROS_ERROR("set_filter: Error setting CAN_RAW_FILTER (%s)", strerror(errno));
     return false;
   }
   return true;
 }
 
-bool CAN::receive_frame(can_frame *frame)
+bool CAN::wait_for_frame()
 {
   fd_set rfds;
 
   FD_ZERO(&rfds);
-  FD_SET(cansocket_, &rfds);
+  FD_SET(rxsocket_, &rfds);
 
   int rc = 1;
   timeval timeout;
@@ -72,7 +448,7 @@ bool CAN::receive_frame(can_frame *frame)
   timeout.tv_sec = 5;
   timeout.tv_usec = 0;
 
-  rc = select(cansocket_ + 1, &rfds, NULL, NULL, &timeout);
+  rc = select(rxsocket_ + 1, &rfds, NULL, NULL, &timeout);
 
   if (rc == 0)
   {
@@ -84,12 +460,419 @@ bool CAN::receive_frame(can_frame *frame)
     ROS_WARN("recive_frame: Error receiving frame (%s)", strerror(errno));
     return false;
   }
+  return true;
+}
+
+// kernel receive time of a frame in seconds (falls back to the current time
+// if the socket delivered no time stamp)
+static double frame_stamp(msghdr *msg)
+{
+  timespec ts;
+
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool CAN::receive_frame(can_frame *frame, double *stamp)
+{
+  return receive_frames(frame, stamp, 1) == 1;
+}
+
+// waits for the first frame, then fetches everything already queued in the
+// socket (up to max frames) with a single recvmmsg; with wait == false the
+// caller already knows the socket is readable (e.g. from epoll) and 0 is
+// returned if nothing is queued
+int CAN::receive_frames(can_frame *frames, double *stamps, size_t max, bool wait)
+{
+  mmsghdr msgs[CAN_BATCH_SIZE];
+  iovec iovs[CAN_BATCH_SIZE];
+  char control[CAN_BATCH_SIZE][CMSG_SPACE(sizeof(timespec))];
+
+  max = std::min(max, (size_t)CAN_BATCH_SIZE);
+
+  if (backend_ == CAN_BACKEND_REPLAY)
+  {
+    int nr;
+    do
+    {
+      int rc = replay_.read_frames(frames, stamps, max, wait);
+      if (rc < 0)
+        return rc;
+      nr = 0;
+      for (int i = 0; i < rc; i++)
+      {
+        if (!accept(frames[i].can_id))
+          continue;
+        frames[nr] = frames[i];
+        stamps[nr] = stamps[i];
+        nr++;
+      }
+    } while (nr == 0 && wait);
+    return nr;
+  }
+
+#ifdef HAVE_LIBURING
+  if (backend_ == CAN_BACKEND_URING)
+    return uring_receive(frames, stamps, max, wait);
+#endif
+
+  if (backend_ == CAN_BACKEND_PACKET)
+  {
+    int nr = read_ring(frames, stamps, max);
+    while (nr == 0 && wait)
+    {
+      if (!wait_for_frame())
+        return -1;
+      nr = read_ring(frames, stamps, max);
+    }
+    return nr;
+  }
 
-  //TODO read time stamp
-  if (read(cansocket_, frame, sizeof(*frame)) != sizeof(*frame))
+  if (wait && !wait_for_frame())
+    return -1;
+
+  memset(msgs, 0, sizeof(msgs[0]) * max);
+  for (size_t i = 0; i < max; i++)
+  {
+    iovs[i].iov_base = &frames[i];
+    iovs[i].iov_len = sizeof(frames[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
+
+  int rc = recvmmsg(cansocket_, msgs, max, MSG_DONTWAIT, NULL);
+  if (rc < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  if (rc < 0)
+  {
+    ROS_WARN("receive_frames: Error reading socket (%s)", strerror(errno));
+    return -1;
+  }
+
+  // drop truncated frames, keep the rest in order
+  int nr = 0;
+  for (int i = 0; i < rc; i++)
   {
-    ROS_WARN("receive_frame: Error reading socket (%s)", strerror(errno));
+    if (msgs[i].msg_len != sizeof(can_frame))
+    {
+      ROS_WARN("receive_frames: Short read (%u bytes)", msgs[i].msg_len);
+      continue;
+    }
+    if (nr != i)
+      frames[nr] = frames[i];
+    stamps[nr] = frame_stamp(&msgs[i].msg_hdr);
+    if (recorder_.is_open())
+      recorder_.write(frames[nr], stamps[nr]);
+    nr++;
+  }
+  return nr;
+}
+
+bool CAN::accept(canid_t id) const
+{
+  if (!filtered_)
+    return true;
+  if (id & (CAN_EFF_FLAG | CAN_RTR_FLAG))
+    return false;
+  return std::find(filter_ids_, filter_ids_ + filter_nr_, id) != filter_ids_ + filter_nr_;
+}
+
+// takes up to max frames out of the receive ring without a syscall; a block
+// is handed back to the kernel as soon as all its frames are read
+int CAN::read_ring(can_frame *frames, double *stamps, size_t max)
+{
+  size_t nr = 0;
+
+  while (nr < max)
+  {
+    tpacket_block_desc *block = (tpacket_block_desc *)(ring_ + (size_t)ring_block_ * CAN_RING_BLOCK_SIZE);
+
+    if (ring_left_ == 0)
+    {
+      if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        break;
+      ring_left_ = block->hdr.bh1.num_pkts;
+      ring_offset_ = block->hdr.bh1.offset_to_first_pkt;
+    }
+
+    if (ring_left_ > 0)
+    {
+      tpacket3_hdr *pkt = (tpacket3_hdr *)((char *)block + ring_offset_);
+      const sockaddr_ll *ll = (const sockaddr_ll *)((char *)pkt + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+      // frames sent by this host show up once more as outgoing packets
+      if (ll->sll_pkttype != PACKET_OUTGOING)
+      {
+        if (pkt->tp_snaplen != sizeof(can_frame))
+        {
+          ROS_WARN("receive_frames: Short read (%u bytes)", pkt->tp_snaplen);
+        }
+        else
+        {
+          const can_frame *frame = (const can_frame *)((char *)pkt + pkt->tp_mac);
+          if (accept(frame->can_id))
+          {
+            frames[nr] = *frame;
+            stamps[nr] = pkt->tp_sec + pkt->tp_nsec * 1e-9;
+            if (recorder_.is_open())
+              recorder_.write(frames[nr], stamps[nr]);
+            nr++;
+          }
+        }
+      }
+
+      ring_offset_ += pkt->tp_next_offset;
+      ring_left_--;
+    }
+
+    if (ring_left_ == 0)
+    {
+      __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+      ring_block_ = (ring_block_ + 1) % CAN_RING_BLOCKS;
+    }
+  }
+  return nr;
+}
+
+#ifdef HAVE_LIBURING
+
+// user data of the io_uring requests: the receive or 1 + TX slot
+#define URING_RX 0
+#define URING_TX 1
+
+// sets up the ring with a provided buffer group for the multishot receive;
+// sends and receives of the raw socket then need at most one io_uring_enter
+// per batch instead of a syscall per frame
+bool CAN::open_uring()
+{
+  int rc = io_uring_queue_init(2 * CAN_URING_BUFS, &uring_, 0);
+  if (rc < 0) {
+    ROS_ERROR("can_init: Error setting up io_uring (%s)", strerror(-rc));
+    return false;
+  }
+  uring_open_ = true;
+
+  rx_ring_ = io_uring_setup_buf_ring(&uring_, CAN_URING_BUFS, 0, 0, &rc);
+  if (rx_ring_ == NULL) {
+    ROS_ERROR("can_init: Error registering receive buffers (%s)", strerror(-rc));
+    return false;
+  }
+  for (int i = 0; i < CAN_URING_BUFS; i++)
+    io_uring_buf_ring_add(rx_ring_, rx_buf_[i], CAN_URING_BUF_SIZE, i, io_uring_buf_ring_mask(CAN_URING_BUFS), i);
+  io_uring_buf_ring_advance(rx_ring_, CAN_URING_BUFS);
+
+  // every buffer holds the recvmsg header, the time stamp and one frame
+  memset(&rx_msg_, 0, sizeof(rx_msg_));
+  rx_msg_.msg_controllen = CMSG_SPACE(sizeof(timespec));
+  if (sizeof(io_uring_recvmsg_out) + rx_msg_.msg_controllen + sizeof(can_frame) > CAN_URING_BUF_SIZE) {
+    ROS_ERROR("can_init: CAN_URING_BUF_SIZE too small");
     return false;
   }
+
+  uring_arm_receive();
+  uring_submit();
   return true;
 }
+
+void CAN::uring_arm_receive()
+{
+  io_uring_sqe *sqe = io_uring_get_sqe(&uring_);
+  if (sqe == NULL)
+    return;
+  io_uring_prep_recvmsg_multishot(sqe, cansocket_, &rx_msg_, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  io_uring_sqe_set_data64(sqe, URING_RX);
+  rx_armed_ = true;
+}
+
+void CAN::uring_submit()
+{
+  if (io_uring_sq_ready(&uring_) == 0)
+    return;
+  int rc = io_uring_submit(&uring_);
+  if (rc < 0)
+    ROS_ERROR("send_frame: Error submitting to io_uring (%s)", strerror(-rc));
+}
+
+// puts a frame the device did not take back in front of the queue, unless
+// a newer frame with the same ID is already waiting
+void CAN::uring_requeue(const can_frame &frame)
+{
+  for (size_t i = 0; i < tx_count_; i++)
+  {
+    if (tx_queue_[i].can_id == frame.can_id)
+    {
+      coalesced_++;
+      return;
+    }
+  }
+  if (tx_count_ == CAN_TX_SLOTS)
+  {
+    ROS_ERROR("send_frame: TX queue full, dropping frame %X", frame.can_id);
+    dropped_++;
+    return;
+  }
+  memmove(tx_queue_ + 1, tx_queue_, tx_count_ * sizeof(tx_queue_[0]));
+  tx_queue_[0] = frame;
+  tx_count_++;
+}
+
+// empties the completion queue: received frames are kept in their buffers
+// until receive_frames() asks for them, finished sends free their slot
+void CAN::uring_reap()
+{
+  io_uring_cqe *cqe;
+
+  while (io_uring_peek_cqe(&uring_, &cqe) == 0)
+  {
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    if (data == URING_RX)
+    {
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+      {
+        size_t i = (rx_head_ + rx_count_) % CAN_URING_BUFS;
+        rx_bid_[i] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        rx_len_[i] = cqe->res;
+        rx_count_++;
+      }
+      // -ENOBUFS: all buffers are waiting to be read, posted again later
+      else if (cqe->res < 0 && cqe->res != -ENOBUFS)
+      {
+        ROS_WARN("receive_frames: Error reading socket (%s)", strerror(-cqe->res));
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        rx_armed_ = false;
+    }
+    else
+    {
+      size_t slot = data - URING_TX;
+      tx_busy_ &= ~(1u << slot);
+      tx_inflight_--;
+      if (cqe->res == -EAGAIN || cqe->res == -ENOBUFS)
+      {
+        // device queue full, retry on the next flush
+        uring_requeue(tx_buf_[slot]);
+      }
+      else if (cqe->res < 0)
+      {
+        ROS_ERROR("send_frame: Error writing socket (%s)", strerror(-cqe->res));
+        dropped_++;
+      }
+    }
+    io_uring_cqe_seen(&uring_, cqe);
+  }
+}
+
+// hands all queued frames to the kernel with a single submit
+bool CAN::uring_flush()
+{
+  uring_reap();
+
+  size_t sent = 0;
+  while (sent < tx_count_ && tx_inflight_ < CAN_URING_TX)
+  {
+    io_uring_sqe *sqe = io_uring_get_sqe(&uring_);
+    if (sqe == NULL)
+      break;
+
+    size_t slot;
+    for (slot = 0; tx_busy_ & (1u << slot); slot++) ;
+    tx_buf_[slot] = tx_queue_[sent++];
+    tx_busy_ |= 1u << slot;
+    tx_inflight_++;
+
+    io_uring_prep_send(sqe, cansocket_, &tx_buf_[slot], sizeof(tx_buf_[slot]), 0);
+    io_uring_sqe_set_data64(sqe, URING_TX + slot);
+  }
+
+  tx_count_ -= sent;
+  memmove(tx_queue_, tx_queue_ + sent, tx_count_ * sizeof(tx_queue_[0]));
+
+  uring_submit();
+  return tx_count_ == 0;
+}
+
+int CAN::uring_receive(can_frame *frames, double *stamps, size_t max, bool wait)
+{
+  uring_reap();
+  while (wait && rx_count_ == 0)
+  {
+    io_uring_cqe *cqe;
+    __kernel_timespec timeout;
+    timeout.tv_sec = 5;
+    timeout.tv_nsec = 0;
+
+    int rc = io_uring_wait_cqe_timeout(&uring_, &cqe, &timeout);
+    if (rc == -ETIME)
+    {
+      ROS_ERROR("recive_frame: Receiving frame timed out (Kurt switched off?)");
+      return -1;
+    }
+    else if (rc < 0 && rc != -EINTR)
+    {
+      ROS_WARN("recive_frame: Error receiving frame (%s)", strerror(-rc));
+      return -1;
+    }
+    uring_reap();
+  }
+
+  size_t nr = 0;
+  int returned = 0;
+  while (nr < max && rx_count_ > 0)
+  {
+    unsigned short bid = rx_bid_[rx_head_];
+    int len = rx_len_[rx_head_];
+    rx_head_ = (rx_head_ + 1) % CAN_URING_BUFS;
+    rx_count_--;
+
+    io_uring_recvmsg_out *out = io_uring_recvmsg_validate(rx_buf_[bid], len, &rx_msg_);
+    unsigned int payload = out ? io_uring_recvmsg_payload_length(out, len, &rx_msg_) : 0;
+    if (payload != sizeof(can_frame) || (out->flags & MSG_TRUNC))
+    {
+      ROS_WARN("receive_frames: Short read (%u bytes)", payload);
+    }
+    else
+    {
+      memcpy(&frames[nr], io_uring_recvmsg_payload(out, &rx_msg_), sizeof(can_frame));
+
+      timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      for (cmsghdr *cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &rx_msg_); cmsg != NULL;
+          cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &rx_msg_, cmsg))
+      {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+          memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      }
+      stamps[nr] = ts.tv_sec + ts.tv_nsec * 1e-9;
+
+      if (recorder_.is_open())
+        recorder_.write(frames[nr], stamps[nr]);
+      nr++;
+    }
+
+    io_uring_buf_ring_add(rx_ring_, rx_buf_[bid], CAN_URING_BUF_SIZE, bid, io_uring_buf_ring_mask(CAN_URING_BUFS), returned++);
+  }
+
+  if (returned > 0)
+    io_uring_buf_ring_advance(rx_ring_, returned);
+  if (!rx_armed_ && rx_count_ < CAN_URING_BUFS)
+  {
+    uring_arm_receive();
+    uring_submit();
+  }
+  return nr;
+}
+
+#endif
@@ -0,0 +1,232 @@
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ros/console.h>
+
+#include "canlog.h"
+
+static double monotonic_now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool CANRecorder::open(const std::string &filename)
+{
+  close();
+
+  file_ = fopen(filename.c_str(), "wb");
+  if (file_ == NULL)
+  {
+    ROS_ERROR("CANRecorder: Error opening %s (%s)", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  CANLogHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CANLOG_MAGIC, sizeof(header.magic));
+  header.version = CANLOG_VERSION;
+  header.record_size = sizeof(CANLogRecord);
+  if (fwrite(&header, sizeof(header), 1, file_) != 1)
+  {
+    ROS_ERROR("CANRecorder: Error writing %s", filename.c_str());
+    close();
+    return false;
+  }
+
+  failed_ = false;
+  dropped_ = 0;
+  running_ = true;
+  int rc = pthread_create(&writer_, NULL, writer_thread, this);
+  if (rc != 0)
+  {
+    ROS_ERROR("CANRecorder: Error starting writer thread (%s)", strerror(rc));
+    running_ = false;
+    close();
+    return false;
+  }
+
+  ROS_INFO("CANRecorder: Recording CAN frames to %s", filename.c_str());
+  return true;
+}
+
+void CANRecorder::close()
+{
+  if (file_ == NULL)
+    return;
+
+  if (running_)
+  {
+    running_ = false;
+    pthread_join(writer_, NULL);
+  }
+  // records queued after the last run of the writer thread
+  write_queued();
+  if (dropped_ > 0)
+    ROS_WARN("CANRecorder: %lu frames not recorded (queue full)", dropped_.load());
+  fclose(file_);
+  file_ = NULL;
+}
+
+// writes everything queued so far, stdio buffers the records
+void CANRecorder::write_queued()
+{
+  CANLogRecord record;
+  while (queue_.pop(record))
+  {
+    if (failed_)
+      continue;
+    if (fwrite(&record, sizeof(record), 1, file_) != 1)
+    {
+      ROS_ERROR("CANRecorder: Error writing record, recording stopped");
+      failed_ = true;
+    }
+  }
+}
+
+void *CANRecorder::writer_thread(void *arg)
+{
+  CANRecorder *recorder = static_cast<CANRecorder *>(arg);
+  timespec period;
+  period.tv_sec = 0;
+  period.tv_nsec = (long)(CANLOG_WRITE_PERIOD * 1e9);
+
+  while (recorder->running_)
+  {
+    recorder->write_queued();
+    nanosleep(&period, NULL);
+  }
+  return NULL;
+}
+
+// called from the receive path: only copies the frame into the queue
+bool CANRecorder::write(const can_frame &frame, double stamp)
+{
+  if (failed_)
+    return false;
+
+  CANLogRecord record;
+  memset(&record, 0, sizeof(record));
+  record.stamp_ns = (uint64_t)llround(stamp * 1e9);
+  record.can_id = frame.can_id;
+  record.can_dlc = frame.can_dlc;
+  memcpy(record.data, frame.data, sizeof(record.data));
+
+  if (!queue_.push(record))
+  {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+bool CANReplay::open(const std::string &filename, double speed)
+{
+  close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    ROS_ERROR("CANReplay: Error opening %s (%s)", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CANLogHeader))
+  {
+    ROS_ERROR("CANReplay: %s is no CAN log", filename.c_str());
+    ::close(fd);
+    return false;
+  }
+
+  map_size_ = st.st_size;
+  map_ = mmap(NULL, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map_ == MAP_FAILED)
+  {
+    ROS_ERROR("CANReplay: Error mapping %s (%s)", filename.c_str(), strerror(errno));
+    map_ = NULL;
+    return false;
+  }
+  madvise(map_, map_size_, MADV_SEQUENTIAL);
+
+  const CANLogHeader *header = static_cast<const CANLogHeader *>(map_);
+  if (memcmp(header->magic, CANLOG_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != CANLOG_VERSION || header->record_size != sizeof(CANLogRecord))
+  {
+    ROS_ERROR("CANReplay: %s has an unknown format", filename.c_str());
+    close();
+    return false;
+  }
+
+  records_ = reinterpret_cast<const CANLogRecord *>(header + 1);
+  nr_ = (map_size_ - sizeof(CANLogHeader)) / sizeof(CANLogRecord);
+  next_ = 0;
+  speed_ = speed;
+  start_ = 0.0;
+
+  ROS_INFO("CANReplay: Replaying %zu CAN frames from %s", nr_, filename.c_str());
+  return true;
+}
+
+void CANReplay::close()
+{
+  if (map_ != NULL)
+    munmap(map_, map_size_);
+  map_ = NULL;
+  records_ = NULL;
+  nr_ = next_ = 0;
+}
+
+// monotonic time at which a record is due
+double CANReplay::due(const CANLogRecord &record) const
+{
+  if (speed_ <= 0.0)
+    return 0.0;
+  return start_ + (record.stamp_ns - records_[0].stamp_ns) * 1e-9 / speed_;
+}
+
+// returns the frames that are due (waiting for the first one if wait is set),
+// 0 if none is due yet and -1 at the end of the log
+int CANReplay::read_frames(can_frame *frames, double *stamps, size_t max, bool wait)
+{
+  if (eof())
+    return -1;
+
+  if (next_ == 0)
+    start_ = monotonic_now();
+
+  if (wait)
+  {
+    double delay = due(records_[next_]) - monotonic_now();
+    if (delay > 0.0)
+    {
+      timespec ts;
+      ts.tv_sec = (time_t)delay;
+      ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  double now = monotonic_now();
+  size_t nr = 0;
+  while (nr < max && !eof() && due(records_[next_]) <= now)
+  {
+    const CANLogRecord &record = records_[next_++];
+    memset(&frames[nr], 0, sizeof(frames[nr]));
+    frames[nr].can_id = record.can_id;
+    frames[nr].can_dlc = record.can_dlc;
+    memcpy(frames[nr].data, record.data, sizeof(record.data));
+    stamps[nr] = record.stamp_ns * 1e-9;
+    nr++;
+  }
+  return nr;
+}
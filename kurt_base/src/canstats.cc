@@ -0,0 +1,152 @@
+#include <cstring>
+
+#include "canstats.h"
+
+double CANIdStats::rate() const
+{
+  if (count < 2 || last_stamp <= first_stamp)
+    return 0.0;
+  return (count - 1) / (last_stamp - first_stamp);
+}
+
+double CANIdStats::mean_dt() const
+{
+  if (count < 2)
+    return 0.0;
+  return sum_dt / (count - 1);
+}
+
+// upper bin edge below which a fraction p of all intervals lie
+double CANIdStats::percentile_dt(double p) const
+{
+  unsigned long nr = count < 2 ? 0 : count - 1;
+  unsigned long limit = (unsigned long)(p * nr);
+  unsigned long sum = 0;
+
+  for (int i = 0; i < CAN_STATS_BINS; i++)
+  {
+    sum += hist[i];
+    if (sum > limit)
+      return (i + 1) * CAN_STATS_BIN_WIDTH;
+  }
+  return max_dt;
+}
+
+void CANLatencyStats::add(double latency)
+{
+  if (count == 0 || latency < min)
+    min = latency;
+  if (count == 0 || latency > max)
+    max = latency;
+  sum += latency;
+  count++;
+
+  int bin = (int)(latency * (1.0 / CAN_LATENCY_BIN_WIDTH));
+  if (bin < 0)
+    bin = 0;
+  else if (bin >= CAN_LATENCY_BINS)
+    bin = CAN_LATENCY_BINS - 1;
+  hist[bin]++;
+}
+
+double CANLatencyStats::mean() const
+{
+  if (count == 0)
+    return 0.0;
+  return sum / count;
+}
+
+// upper bin edge below which a fraction p of all latencies lie
+double CANLatencyStats::percentile(double p) const
+{
+  unsigned long limit = (unsigned long)(p * count);
+  unsigned long sum = 0;
+
+  for (int i = 0; i < CAN_LATENCY_BINS; i++)
+  {
+    sum += hist[i];
+    if (sum > limit)
+      return (i + 1) * CAN_LATENCY_BIN_WIDTH;
+  }
+  return max;
+}
+
+CANStats::CANStats() :
+  stamp(0.0),
+  tx_coalesced(0),
+  tx_dropped(0),
+  control_frames(0),
+  control_skipped(0),
+  odometry_bridged(0),
+  gyro_disagreements(0),
+  nr_(0),
+  unknown_(0)
+{
+  memset(slot_of_, 0, sizeof(slot_of_));
+  memset(stats_, 0, sizeof(stats_));
+  memset(&control_latency, 0, sizeof(control_latency));
+}
+
+// slots are only ever added, so slot i of last holds the same ID
+double CANStats::rate(size_t i, const CANStats &last) const
+{
+  double dt = stamp - last.stamp;
+  if (dt <= 0.0)
+    return 0.0;
+  unsigned long before = i < last.nr_ ? last.stats_[i].count : 0;
+  return (stats_[i].count - before) / dt;
+}
+
+CANIdStats *CANStats::slot(canid_t id)
+{
+  if (id >= CAN_STATS_IDS)
+    return NULL;
+  if (slot_of_[id] == 0)
+  {
+    if (nr_ == CAN_STATS_SLOTS)
+      return NULL;
+    stats_[nr_].id = id;
+    slot_of_[id] = ++nr_;
+  }
+  return &stats_[slot_of_[id] - 1];
+}
+
+void CANStats::frame(canid_t id, double stamp)
+{
+  CANIdStats *s = slot(id);
+  if (s == NULL)
+  {
+    unknown_++;
+    return;
+  }
+
+  if (s->count == 0)
+  {
+    s->first_stamp = stamp;
+  }
+  else
+  {
+    double dt = stamp - s->last_stamp;
+    if (s->count == 1 || dt < s->min_dt)
+      s->min_dt = dt;
+    if (dt > s->max_dt)
+      s->max_dt = dt;
+    s->sum_dt += dt;
+
+    int bin = (int)(dt * (1.0 / CAN_STATS_BIN_WIDTH));
+    if (bin < 0)
+      bin = 0;
+    else if (bin >= CAN_STATS_BINS)
+      bin = CAN_STATS_BINS - 1;
+    s->hist[bin]++;
+  }
+  s->last_stamp = stamp;
+  s->count++;
+}
+
+void CANStats::error(canid_t id)
+{
+  CANIdStats *s = slot(id);
+  if (s != NULL)
+    s->errors++;
+}
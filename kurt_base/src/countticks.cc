@@ -1,5 +1,11 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
 
 #include "kurt.h"
 #include "stdoutcomm.h"
@@ -7,19 +13,178 @@
 
 void usage(char *pgrname)
 {
-  printf("%s: <pwml> <pwmr> <nr_turns> <nr_ticks> (radumdrehungen zaehlen)\n",pgrname);
+  printf("%s: <pwml> <pwmr> <nr_turns> <nr_ticks> [can-interface] (radumdrehungen zaehlen)\n",pgrname);
   printf("e.g. %s 400 400 10 2050\n",pgrname);
+  printf("%s: -c <yaml-file> [-p pwm] [-d distance] [-n turns] [-w wheel_perimeter] [-a axis_length] [-t ticks_per_turn] [can-interface]\n",pgrname);
+  printf("  calibrates ticks_per_turn_of_wheel, wheel_perimeter and turning_adaptation\n");
+  printf("  from straight runs of about distance m (default 2) and turns on the spot\n");
+  printf("  of turns revolutions (default 1); asks for the distance driven after\n");
+  printf("  each straight run and writes the result as ROS parameters; -w, -a and -t\n");
+  printf("  are the current odometry parameters of the robot\n");
+}
+
+// one maneuver: encoder ticks of both wheels, heading change from the gyro
+// and the measured distance (< 0 if unknown)
+struct Maneuver
+{
+  double ticks_l, ticks_r;
+  double theta;
+  double distance;
+};
+
+static void wait_encoder(Kurt &kurt)
+{
+  while (kurt.can_read_fifo() != CAN_ENCODER) ;
+}
+
+// drives with pwm in the given directions until done() returns true, then
+// stops and waits one second until the robot stands still
+template <typename Done>
+static Maneuver drive(Kurt &kurt, STDoutComm &comm, int pwm, char dir_l, char dir_r, Done done)
+{
+  Maneuver m;
+  long long start_l = comm.K_get_sum_ticks_a();
+  long long start_r = comm.K_get_sum_ticks_b();
+  double start_theta = comm.gyro_sum();
+
+  for (int frames = 0; !done(); frames++) {
+    // alle 50 ms senden, sonst ausfall nach 100 ms
+    if (frames % 5 == 0)
+      kurt.can_motor(1024 - pwm, dir_l, 0, 1024 - pwm, dir_r, 0);
+    wait_encoder(kurt);
+  }
+  for (int frames = 0; frames < 100; frames++) {
+    if (frames % 5 == 0)
+      kurt.can_motor(1023, 0, 0, 1023, 0, 0);
+    wait_encoder(kurt);
+  }
+
+  m.ticks_l = (long long)comm.K_get_sum_ticks_a() - start_l;
+  m.ticks_r = (long long)comm.K_get_sum_ticks_b() - start_r;
+  m.theta = comm.gyro_sum() - start_theta;
+  m.distance = -1.0;
+  return m;
+}
+
+static int calibrate(const char *filename, int pwm, double distance, int turns,
+    double wheel_perimeter, double axis_length, int ticks_per_turn, const CANConfig &can_config)
+{
+  STDoutComm comm;
+  Kurt kurt(comm, wheel_perimeter, axis_length, KURT_TURNING_ADAPTATION, ticks_per_turn, can_config);
+  std::vector<Maneuver> maneuvers;
+  char line[64];
+
+  // Kurt drops the first 100 gyro frames while the gyro settles, with the
+  // 100 samples waited for here that is about 2 s at 100 Hz
+  printf("Waiting for the gyro\n");
+  while (comm.gyro_nr() < 100)
+    wait_encoder(kurt);
+
+  // geradeaus vor und zurueck, ticks mit den gegebenen parametern geschaetzt
+  double ticks = distance / wheel_perimeter * ticks_per_turn;
+  for (int dir = 0; dir < 2; dir++) {
+    long long start_l = comm.K_get_sum_ticks_a();
+    Maneuver m = drive(kurt, comm, pwm, dir, dir, [&]() {
+        return fabs((double)((long long)comm.K_get_sum_ticks_a() - start_l)) >= ticks; });
+    printf("Distance driven %s in m (empty if not measured): ", dir == 0 ? "forward" : "backward");
+    fflush(stdout);
+    if (fgets(line, sizeof(line), stdin) != NULL && sscanf(line, "%lf", &m.distance) != 1)
+      m.distance = -1.0;
+    maneuvers.push_back(m);
+  }
+
+  // auf der stelle links und rechts herum bis der gyro turns umdrehungen meldet
+  for (int dir = 0; dir < 2; dir++) {
+    double start = comm.gyro_sum();
+    maneuvers.push_back(drive(kurt, comm, pwm, dir == 0 ? 1 : 0, dir == 0 ? 0 : 1, [&]() {
+        return fabs(comm.gyro_sum() - start) >= 2.0 * M_PI * turns; }));
+  }
+
+  // least squares: distance = m * ticks for the straight runs with a
+  // measured distance, theta = m * turning_adaptation / axis_length * (r - l)
+  // for all maneuvers
+  double sum_tt = 0.0, sum_td = 0.0, sum_dd = 0.0, sum_dth = 0.0, sum_thth = 0.0;
+  for (size_t i = 0; i < maneuvers.size(); i++) {
+    const Maneuver &m = maneuvers[i];
+    printf("maneuver %zu: ticks left %.0f right %.0f gyro %.4f rad distance %.3f m\n",
+        i, m.ticks_l, m.ticks_r, m.theta, m.distance);
+    if (m.distance >= 0.0) {
+      double t = 0.5 * (fabs(m.ticks_l) + fabs(m.ticks_r));
+      sum_tt += t * t;
+      sum_td += t * m.distance;
+    }
+    double d = m.ticks_r - m.ticks_l;
+    sum_dd += d * d;
+    sum_dth += d * m.theta;
+    sum_thth += m.theta * m.theta;
+  }
+
+  // m per tick, from the straight runs or from the given wheel perimeter
+  double meter_per_tick = sum_tt > 0.0 ? sum_td / sum_tt : wheel_perimeter / ticks_per_turn;
+  if (sum_tt == 0.0)
+    printf("No distance measured, keeping %.4f m per %d ticks\n", wheel_perimeter, ticks_per_turn);
+  if (sum_dd == 0.0 || sum_dth <= 0.0) {
+    printf("Turns not usable (gyro and encoders disagree on the direction)\n");
+    return 1;
+  }
+  double turning_adaptation = axis_length / meter_per_tick * sum_dth / sum_dd;
+  double rms_theta = sqrt(std::max(0.0, (sum_thth - sum_dth * sum_dth / sum_dd) / maneuvers.size()));
+
+  // ticks per turn are an integer ratio of encoder and gears, the wheel
+  // perimeter then follows from the measured m per tick
+  int ticks_per_turn_of_wheel = (int)lround(wheel_perimeter / meter_per_tick);
+  wheel_perimeter = meter_per_tick * ticks_per_turn_of_wheel;
+
+  printf("ticks_per_turn_of_wheel: %d\n", ticks_per_turn_of_wheel);
+  printf("wheel_perimeter: %.4f\n", wheel_perimeter);
+  printf("turning_adaptation: %.4f (rms gyro residual %.4f rad)\n", turning_adaptation, rms_theta);
+
+  FILE *fpw = fopen(filename, "w");
+  if (fpw == NULL) {
+    perror(filename);
+    return 1;
+  }
+  fprintf(fpw, "# kurt_base odometry parameters from kurt_countticks -c\n");
+  fprintf(fpw, "wheel_perimeter: %.4f\n", wheel_perimeter);
+  fprintf(fpw, "axis_length: %.4f\n", axis_length);
+  fprintf(fpw, "turning_adaptation: %.4f\n", turning_adaptation);
+  fprintf(fpw, "ticks_per_turn_of_wheel: %d\n", ticks_per_turn_of_wheel);
+  fclose(fpw);
+  printf("Written to %s\n", filename);
+  return 0;
 }
 
 int main(int argc, char **argv)
 {
   FILE *fpr = NULL;
-  long double Time_Diff1 = 101.0; // time
-  long double Time_Diffa = 0.0; // time
-  long double Time_Diffb = 0.0; // time
   int i,j, k;
   int startpwml = 400, startpwmr = 400, nr_turns = 10, nr_ticks = 2050;
 
+  const char *calibration = NULL;
+  int pwm = 400, turns = 1, ticks_per_turn = KURT_TICKS_PER_TURN;
+  double distance = 2.0, perimeter = KURT_WHEEL_PERIMETER, axis = KURT_AXIS_LENGTH;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:p:d:n:w:a:t:h")) != -1) {
+    switch (opt) {
+      case 'c': calibration = optarg; break;
+      case 'p': pwm = atoi(optarg); break;
+      case 'd': distance = atof(optarg); break;
+      case 'n': turns = atoi(optarg); break;
+      case 'w': perimeter = atof(optarg); break;
+      case 'a': axis = atof(optarg); break;
+      case 't': ticks_per_turn = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+        return 0;
+    }
+  }
+  if (calibration != NULL) {
+    CANConfig can_config;
+    if (optind < argc)
+      can_config.interface = argv[optind];
+    return calibrate(calibration, pwm, distance, turns, perimeter, axis, ticks_per_turn, can_config);
+  }
+
   if (argc < 5) {
     usage(argv[0]);
     return 0;
@@ -30,24 +195,32 @@ int main(int argc, char **argv)
     nr_turns = atoi(argv[3]);
     nr_ticks = atoi(argv[4]);
   }
+  CANConfig can_config;
+  if (argc > 5)
+    can_config.interface = argv[5];
 
   fpr = fopen("distance-test.dat","w");
 
   mydelay(200);
 
   //Odometry parameter (defaults for kurt2 indoor)
-  double wheel_perimeter = 0.379;
-  double axis_length = 0.28;
+  double wheel_perimeter = KURT_WHEEL_PERIMETER;
+  double axis_length = KURT_AXIS_LENGTH;
 
-  double turning_adaptation = 0.69;
-  int ticks_per_turn_of_wheel = 21950;
+  double turning_adaptation = KURT_TURNING_ADAPTATION;
+  int ticks_per_turn_of_wheel = KURT_TICKS_PER_TURN;
 
   STDoutComm stdoutcomm;
-  Kurt kurt(stdoutcomm, wheel_perimeter, axis_length, turning_adaptation, ticks_per_turn_of_wheel);
+  Kurt kurt(stdoutcomm, wheel_perimeter, axis_length, turning_adaptation, ticks_per_turn_of_wheel, can_config);
 
-  Get_mtime_diff(2);
-  Get_mtime_diff(3);
-  Get_mtime_diff(4);
+  // run time, alle 100 ms senden und wie lange jedes rad schon steht
+  MyTimer start, stopped_a, stopped_b;
+  MyPeriodic send;
+  mytime_start(&start);
+  mytime_start(&stopped_a);
+  mytime_start(&stopped_b);
+  mytime_periodic_start(&send, MYTIME_MS(100));
+  kurt.can_motor(1024 - startpwml, 0, 0, 1024 - startpwmr, 0, 0);
 
   i = startpwml;
   j = startpwmr;
@@ -58,24 +231,21 @@ int main(int argc, char **argv)
     // speed auf die motoren
     pwm_left = 1024-i;
     pwm_right = 1024-j;
-    Time_Diff1 += Get_mtime_diff(3);
-    if (Time_Diff1 > 100.0) {
+    if (mytime_periodic_due(&send)) {
       kurt.can_motor(pwm_left, 0, 0, pwm_right, 0, 0);
-      Time_Diff1 = 0.0;
     }
     //printf("out %d\n",i);
     // werte von den winkel encodern
     while (kurt.can_read_fifo() != CAN_ENCODER) ;
 
     fprintf(fpr,"%Lf %lf %lf %lf %lld %lld\n",
-        Get_mtime_diff(9),
+        mytime_elapsed_ms(&start),
         stdoutcomm.v1(),stdoutcomm.v1_left(),stdoutcomm.v1_right(),
         stdoutcomm.K_get_sum_ticks_a(),
         stdoutcomm.K_get_sum_ticks_b());
 
     // xx umdrehungen pro rad zaehlen
     if (abs(stdoutcomm.K_get_sum_ticks_a()) > nr_ticks*nr_turns-200) {
-      Time_Diffa += Get_mtime_diff(2);
       if ( i > 0) {
         i = 0;
         pwm_left = 1024-i;
@@ -84,14 +254,12 @@ int main(int argc, char **argv)
 
     }
     else {
-      Get_mtime_diff(2);
-      Time_Diffa = 0.0;
+      mytime_start(&stopped_a);
     }
     // fuer kurt2 mit 90 watt motoren und 1:14 getriebe
     // encoder 500 oder 1000 / umdrehung
     // umsetzung kette ??
     if (abs(stdoutcomm.K_get_sum_ticks_b()) > nr_ticks*nr_turns-200) {
-      Time_Diffb += Get_mtime_diff(4);
       if (j > 0) {
         j = 0;
         pwm_right = 1024-j;
@@ -100,19 +268,19 @@ int main(int argc, char **argv)
 
     }
     else {
-      Get_mtime_diff(4);
-      Time_Diffb = 0.0;
+      mytime_start(&stopped_b);
     }
 
-  } while ((Time_Diffa < 3000.0) || (Time_Diffb < 3000.0));
+  } while ((mytime_elapsed_ms(&stopped_a) < 3000.0) || (mytime_elapsed_ms(&stopped_b) < 3000.0));
   fclose(fpr);
 
   // langsames stoppen ueber 1024 / 2 * 10 ms
+  mytime_periodic_start(&send, MYTIME_MS(10));
   for (k = 0; k < i; k+=2 ) {
     pwm_left = 1024-i+k;
     pwm_right = 1024-j+k;
     kurt.can_motor(pwm_left, 0, 0, pwm_right, 0, 0);
-    mydelay(10);
+    mytime_periodic_wait(&send);
   }
 
   printf("Closing the can connection\n");
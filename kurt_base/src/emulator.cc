@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <getopt.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "can.h"
+#include "kurt.h"
+
+// Emulates the C167 board of Kurt on a (virtual) CAN interface: answers
+// CAN_CONTROL in RAW and SPEED_CM mode and CAN_SETROTUNT, integrates a
+// first order motor and encoder model and sends the sensor frames every
+// 10 ms like the real board.
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int)
+{
+  running = 0;
+}
+
+struct EmulatorConfig
+{
+  EmulatorConfig() :
+    interface("vcan0"),
+    jitter(0.0),
+    loss(0.0),
+    watchdog(CONTROL_WATCHDOG),
+    vmax(0.9),
+    tau(0.1),
+    wheel_perimeter(KURT_WHEEL_PERIMETER),
+    axis_length(KURT_AXIS_LENGTH),
+    ticks_per_turn_of_wheel(KURT_TICKS_PER_TURN) { }
+
+  std::string interface;
+  double jitter;   // [s] maximum random delay of the sensor frames per cycle
+  double loss;     // probability of losing a frame
+  double watchdog; // [s] motors stop without CAN_CONTROL for this long
+  double vmax;     // [m/s] wheel speed at full PWM
+  double tau;      // [s] time constant of the motors
+  double wheel_perimeter;
+  double axis_length;
+  int ticks_per_turn_of_wheel;
+};
+
+class KurtEmulator
+{
+  public:
+    KurtEmulator(const EmulatorConfig &config);
+
+    void run();
+
+  private:
+    void receive(double now);
+    void control(const can_frame &frame, double now);
+    void step(double dt, double now);
+    void send(can_frame &frame, canid_t id);
+    void send_sensors();
+
+    const EmulatorConfig &config_;
+    CAN can_;
+
+    // wheel speed setpoints and current speeds [m/s]
+    double target_l_, target_r_;
+    double v_l_, v_r_;
+    double last_control_;
+    // encoder ticks not sent yet (fractional)
+    double ticks_l_, ticks_r_;
+    int encoder_l_, encoder_r_;
+    // accumulated ticks for CAN_GETSPEED
+    uint32_t odo_l_, odo_r_;
+    // heading [rad] as seen by the gyro
+    double theta_;
+    // rotunit speed [rad/s] and angle [rad]
+    double rot_speed_, rot_;
+
+    unsigned long sent_, lost_, controls_, timeouts_;
+    // longest interval between two CAN_CONTROL frames while driving
+    double max_control_gap_;
+    bool stopped_by_watchdog_;
+};
+
+static CANConfig can_config(const EmulatorConfig &config)
+{
+  CANConfig can_config;
+  can_config.interface = config.interface;
+  return can_config;
+}
+
+KurtEmulator::KurtEmulator(const EmulatorConfig &config) :
+  config_(config),
+  can_(can_config(config)),
+  target_l_(0.0), target_r_(0.0),
+  v_l_(0.0), v_r_(0.0),
+  last_control_(0.0),
+  ticks_l_(0.0), ticks_r_(0.0),
+  encoder_l_(0), encoder_r_(0),
+  odo_l_(0), odo_r_(0),
+  theta_(0.0),
+  rot_speed_(0.0), rot_(0.0),
+  sent_(0), lost_(0), controls_(0), timeouts_(0),
+  max_control_gap_(0.0),
+  stopped_by_watchdog_(true)
+{
+  canid_t ids[] = { CAN_CONTROL, CAN_SETROTUNT };
+  can_.set_filter(ids, sizeof(ids) / sizeof(ids[0]));
+}
+
+static double monotonic_now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int16_t be16(const __u8 *data)
+{
+  return (int16_t)((data[0] << 8) | data[1]);
+}
+
+void KurtEmulator::control(const can_frame &frame, double now)
+{
+  if (frame.can_id == CAN_SETROTUNT)
+  {
+    // inverse of Kurt::can_rotunit_send
+    rot_speed_ = be16(&frame.data[0]) * 20.0 / 10240.0 * 2.0 * M_PI;
+    return;
+  }
+
+  int mode = be16(&frame.data[0]);
+  if (mode == RAW)
+  {
+    // 1023 = stop, 0 = full speed; bit 1 direction, bit 0 brake
+    int pwm_l = ((frame.data[3] << 8) | frame.data[4]) & 0x3FF;
+    int pwm_r = ((frame.data[6] << 8) | frame.data[7]) & 0x3FF;
+    double sign_l = (frame.data[2] & 2) ? -1.0 : 1.0;
+    double sign_r = (frame.data[5] & 2) ? -1.0 : 1.0;
+    target_l_ = (frame.data[2] & 1) ? 0.0 : sign_l * config_.vmax * (1023 - pwm_l) / 1023.0;
+    target_r_ = (frame.data[5] & 1) ? 0.0 : sign_r * config_.vmax * (1023 - pwm_r) / 1023.0;
+  }
+  else if (mode == SPEED_CM)
+  {
+    target_l_ = be16(&frame.data[2]) / 100.0;
+    target_r_ = be16(&frame.data[4]) / 100.0;
+  }
+  else
+  {
+    fprintf(stderr, "kurt_emulator: unknown control mode %d\n", mode);
+    return;
+  }
+
+  controls_++;
+  if (!stopped_by_watchdog_)
+    max_control_gap_ = std::max(max_control_gap_, now - last_control_);
+  last_control_ = now;
+  stopped_by_watchdog_ = false;
+}
+
+void KurtEmulator::receive(double now)
+{
+  can_frame frames[CAN_BATCH_SIZE];
+  double stamps[CAN_BATCH_SIZE];
+
+  int nr = can_.receive_frames(frames, stamps, CAN_BATCH_SIZE, false);
+  for (int i = 0; i < nr; i++)
+    control(frames[i], now);
+}
+
+void KurtEmulator::step(double dt, double now)
+{
+  if (!stopped_by_watchdog_ && now - last_control_ > config_.watchdog)
+  {
+    target_l_ = target_r_ = 0.0;
+    stopped_by_watchdog_ = true;
+    timeouts_++;
+  }
+
+  double a = std::min(1.0, dt / config_.tau);
+  v_l_ += (target_l_ - v_l_) * a;
+  v_r_ += (target_r_ - v_r_) * a;
+
+  ticks_l_ += v_l_ * dt / config_.wheel_perimeter * config_.ticks_per_turn_of_wheel;
+  ticks_r_ += v_r_ * dt / config_.wheel_perimeter * config_.ticks_per_turn_of_wheel;
+  encoder_l_ = (int)ticks_l_;
+  encoder_r_ = (int)ticks_r_;
+  ticks_l_ -= encoder_l_;
+  ticks_r_ -= encoder_r_;
+  odo_l_ += encoder_l_;
+  odo_r_ += encoder_r_;
+
+  theta_ += (v_r_ - v_l_) / config_.axis_length * dt;
+  theta_ = atan2(sin(theta_), cos(theta_));
+
+  rot_ = fmod(rot_ + rot_speed_ * dt, 2.0 * M_PI);
+  if (rot_ < 0.0)
+    rot_ += 2.0 * M_PI;
+}
+
+void KurtEmulator::send(can_frame &frame, canid_t id)
+{
+  if (drand48() < config_.loss)
+  {
+    lost_++;
+    return;
+  }
+  frame.can_id = id;
+  frame.can_dlc = 8;
+  can_.send_frame(&frame);
+  sent_++;
+}
+
+static void put16(__u8 *data, int value)
+{
+  data[0] = (value >> 8) & 0xFF;
+  data[1] = value & 0xFF;
+}
+
+static void put32(__u8 *data, long value)
+{
+  data[0] = (value >> 24) & 0xFF;
+  data[1] = (value >> 16) & 0xFF;
+  data[2] = (value >> 8) & 0xFF;
+  data[3] = value & 0xFF;
+}
+
+void KurtEmulator::send_sensors()
+{
+  can_frame frame;
+
+  memset(&frame, 0, sizeof(frame));
+  put16(&frame.data[0], encoder_l_);
+  put16(&frame.data[2], encoder_r_);
+  send(frame, CAN_ENCODER);
+
+  memset(&frame, 0, sizeof(frame));
+  put32(&frame.data[0], odo_l_);
+  put32(&frame.data[4], odo_r_);
+  send(frame, CAN_GETSPEED);
+
+  // gyro angle in 1/4992511 deg, sigma in 1/10000 deg
+  memset(&frame, 0, sizeof(frame));
+  put32(&frame.data[0], lround(theta_ * 180.0 / M_PI * 4992511.0));
+  put32(&frame.data[4], 100);
+  send(frame, CAN_GYRO_MC1);
+
+  // second gyro with a slightly larger sigma
+  memset(&frame, 0, sizeof(frame));
+  put32(&frame.data[0], lround(theta_ * 180.0 / M_PI * 4992511.0));
+  put32(&frame.data[4], 150);
+  send(frame, CAN_GYRO_MC2);
+
+  // free space: IR and ultrasound readings of about 0.4 m, level tilt sensor
+  memset(&frame, 0, sizeof(frame));
+  put16(&frame.data[0], 400);
+  put16(&frame.data[2], 400);
+  put16(&frame.data[4], 400);
+  send(frame, CAN_ADC00_03);
+
+  memset(&frame, 0, sizeof(frame));
+  put16(&frame.data[0], 400);
+  put16(&frame.data[2], 500);
+  put16(&frame.data[4], 400);
+  put16(&frame.data[6], 400);
+  send(frame, CAN_ADC04_07);
+
+  memset(&frame, 0, sizeof(frame));
+  put16(&frame.data[2], 400);
+  send(frame, CAN_ADC08_11);
+
+  memset(&frame, 0, sizeof(frame));
+  put16(&frame.data[0], 32768);
+  put16(&frame.data[2], 32768);
+  send(frame, CAN_TILT_COMP);
+
+  memset(&frame, 0, sizeof(frame));
+  put16(&frame.data[1], (int)(rot_ / (2.0 * M_PI) * 10240) % 10240);
+  send(frame, CAN_GETROTUNIT);
+}
+
+void KurtEmulator::run()
+{
+  timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  double last = monotonic_now();
+  double start = last;
+
+  while (running)
+  {
+    // board cycle of 10 ms
+    next.tv_nsec += 10000000;
+    if (next.tv_nsec >= 1000000000)
+    {
+      next.tv_nsec -= 1000000000;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    double now = monotonic_now();
+    receive(now);
+    step(now - last, now);
+    last = now;
+
+    if (config_.jitter > 0.0)
+      usleep((useconds_t)(drand48() * config_.jitter * 1e6));
+    send_sensors();
+  }
+
+  printf("sent: %lu lost: %lu controls: %lu watchdog stops: %lu\n", sent_, lost_, controls_, timeouts_);
+  printf("controls per s: %.1f longest gap: %.1f ms\n",
+      controls_ / (monotonic_now() - start), max_control_gap_ * 1000.0);
+}
+
+void usage(char *pgrname)
+{
+  printf("%s: [-i interface] [-j jitter] [-l loss] [-w watchdog] [-s seed]\n", pgrname);
+  printf("  -i  CAN interface (default vcan0)\n");
+  printf("  -j  maximum random delay of the sensor frames in s (default 0)\n");
+  printf("  -l  probability of losing a frame (default 0)\n");
+  printf("  -w  stop the motors after this many s without CAN_CONTROL (default %g)\n", CONTROL_WATCHDOG);
+  printf("  -s  random seed\n");
+}
+
+int main(int argc, char **argv)
+{
+  EmulatorConfig config;
+  long seed = time(NULL);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:j:l:w:s:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        config.interface = optarg;
+        break;
+      case 'j':
+        config.jitter = atof(optarg);
+        break;
+      case 'l':
+        config.loss = atof(optarg);
+        break;
+      case 'w':
+        config.watchdog = atof(optarg);
+        break;
+      case 's':
+        seed = atol(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 0;
+    }
+  }
+
+  srand48(seed);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  KurtEmulator emulator(config);
+  emulator.run();
+  return 0;
+}
@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
 
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -15,7 +17,11 @@ Kurt::~Kurt()
 {
   if(use_rotunit_)
     can_rotunit_send(0.0);
+  if (bcm_active_)
+    can_.stop_periodic_frame(CAN_CONTROL);
   k_hard_stop();
+  if (leerlauf_learn_)
+    save_feedforward_adaptation(leerlauf_file_);
   if(!use_microcontroller_)
   {
     free(pwm_v_l_);
@@ -79,36 +85,37 @@ void Kurt::k_hard_stop(void)
   dir_right = 0;
   brake_right = 1;
 
-  do
-  { }
-  while (!can_motor(pwm_left, dir_left, brake_left, pwm_right, dir_right, brake_right));
+  // give the stop frame up to 100 ms to leave a congested TX queue
+  can_motor(pwm_left, dir_left, brake_left, pwm_right, dir_right, brake_right);
+  if (!can_.drain(100))
+    ROS_ERROR("k_hard_stop: Stop frame could not be sent");
 }
 
 // PWM Lookup
 // basis zuordnung
 // darueber liegt ein PID geschwindigkeits regler
+// pwm for speed v from the speed table plus the learned offset of its bin
+int Kurt::feedforward(const int *pwm_v, const double *adapt, double v) const
+{
+  int index = std::min(nr_v_ - 1, (int)(fabs(v) / vmax_ * nr_v_));
+  int bin = std::min(ADAPT_BINS - 1, (int)(fabs(v) / vmax_ * ADAPT_BINS));
+  return pwm_v[index] + (int)lround(adapt[bin]);
+}
+
 // Leerlauf adaption fuer den Teppich boden und geradeaus fahrt
-void Kurt::set_wheel_speed1(double v_l, double v_r, int integration_l, int integration_r)
+// returns whether the CAN_CONTROL frame was queued
+bool Kurt::set_wheel_speed1(double v_l, double v_r, int integration_l, int integration_r)
 {
   unsigned short pwm_left, pwm_right;
   unsigned char dir_left, dir_right, brake_left, brake_right;
 
-  int index_l, index_r; // point in speed_pwm tabelle
-
-  // calc pwm values form speed array
-  index_l = (int)(fabs(v_l) / vmax_ * nr_v_);
-  index_r = (int)(fabs(v_r) / vmax_ * nr_v_);
-
-  index_l = std::min(nr_v_ - 1, index_l);
-  index_r = std::min(nr_v_ - 1, index_r);
-
   // 1023 = zero, 0 = maxspeed
   if (fabs(v_l) > 0.01)
-    pwm_left = std::max(0, std::min(1023, 1024 - pwm_v_l_[index_l] - leerlauf_adapt_ - integration_l));
+    pwm_left = std::max(0, std::min(1023, 1024 - feedforward(pwm_v_l_, leerlauf_adapt_l_, v_l) - integration_l));
   else
     pwm_left = 1023;
   if (fabs(v_r) > 0.01)
-    pwm_right = std::max(0, std::min(1023, 1024 - pwm_v_r_[index_r] - leerlauf_adapt_ - integration_r));
+    pwm_right = std::max(0, std::min(1023, 1024 - feedforward(pwm_v_r_, leerlauf_adapt_r_, v_r) - integration_r));
   else
     pwm_right = 1023;
 
@@ -125,158 +132,157 @@ void Kurt::set_wheel_speed1(double v_l, double v_r, int integration_l, int integ
   brake_left = 0;
   brake_right = 0;
 
-  can_motor(pwm_left, dir_left, brake_left, pwm_right, dir_right, brake_right);
+  return can_motor(pwm_left, dir_left, brake_left, pwm_right, dir_right, brake_right) == 0;
 }
 
-// pid geschwindigkeits regler fuers linke und rechte rad
-// omega wird benoetig um die integration fuer den darunterstehenden regler
-// zu berechnen
-void Kurt::set_wheel_speed2(double _v_l_soll, double _v_r_soll, double _v_l_ist,
-    double _v_r_ist, double _omega, double _AntiWindup)
-{
-  // stellgroessen v=speed, l= links, r= rechts
-  static double zl = 0.0, zr = 0.0;
-  static double last_zl = 0.0, last_zr = 0.0;
-  // regelabweichung e = soll - ist;
-  static double el = 0.0, er = 0.0;
-  static double last_el = 0.0, last_er = 0.0;
-  // integral
-  static double int_el = 0.0, int_er = 0.0;
-  // differenzieren
-  static double del = 0.0, der = 0.0;
-  // zeitinterval
-  double dt = 0.01;
-  // filter fuer gueltige Werte
-  static double last_v_l_ist = 0.0, last_v_r_ist = 0.0;
-  // static int reached = 0;
-
-  // These arrays need to be initialized because we read from indices 0, 1, 2
-  // before writing to them. If an array is partially initialized, elements
-  // that are not initialized receive the value 0 of the appropriate type, so
-  // initializing the first value is enough.
-  static double v_l_list[MAX_V_LIST] = {0.0}, v_r_list[MAX_V_LIST] = {0.0};
-  static int vl_index = 3, vr_index = 3;
-  int i;
-  static double f_v_l_ist, f_v_r_ist;
-  // kd_l and kd_r allways 0 (using only pi controller here)
-  double kd_l = 0.0, kd_r = 0.0; // nur pi regler d-anteil ausblenden
-
-  int_el *= _AntiWindup;
-  int_er *= _AntiWindup;
-
-  last_v_l_ist *= _AntiWindup;
-  last_v_r_ist *= _AntiWindup;
-
-  double turn_feedforward_l = -_omega / M_PI * feedforward_turn_;
-  double turn_feedforward_r = _omega / M_PI * feedforward_turn_;
-
-  // filtern: grosser aenderungen deuten auf fehlerhafte messungen hin
-  if (fabs(_v_l_ist - last_v_l_ist) < 0.19)
-  {
-    // filter glaettung werte speichern
-    v_l_list[vl_index] = _v_l_ist;
-    f_v_l_ist = (v_l_list[vl_index] + v_l_list[vl_index - 1] + v_l_list[vl_index - 2] + v_l_list[vl_index - 3]) / 4.0;
-    vl_index++; // achtung auf ueberlauf
-    if (vl_index >= MAX_V_LIST)
-    {
-      vl_index = 3; // zum schutz vor ueberlauf kopieren bei hold einen mehr kopieren
-      for (i = 0; i < 3; i++)
-        v_l_list[2 - i] = v_l_list[MAX_V_LIST - i - 1];
-    }
-
-    el = _v_l_soll - f_v_l_ist;
-    del = (el - last_el) / dt;
-    int_el += el * dt;
+void Kurt::WheelControl::reset()
+{
+  z = last_z = 0.0;
+  e = last_e = 0.0;
+  int_e = 0.0;
+  de = 0.0;
+  last_v_ist = 0.0;
+  // we read from indices 0, 1, 2 before writing to them
+  for (int i = 0; i < MAX_V_LIST; i++)
+    v_list[i] = 0.0;
+  index = 3;
+  f_v_ist = 0.0;
+  last_v_soll = 0.0;
+  steady = 0.0;
+}
 
-    zl = kp_l * el + kd_l * del + ki_l * int_el + _v_l_soll + turn_feedforward_l;
+// pi geschwindigkeits regler fuer ein rad, gibt die stellgroesse zurueck
+// feedforward ist der anteil fuer die drehung
+// dt ist das regelintervall, die zeit zwischen den letzten beiden aufrufen
+// von set_wheel_speed (beim ersten aufruf, bei dt <= 0 und bei luecken ueber
+// CONTROL_DT_MAX die nominelle regelperiode); integral und begrenzung der
+// schrittweite werden damit skaliert
+double Kurt::control_wheel(WheelControl &w, double v_soll, double v_ist,
+    double kp, double ki, double feedforward, double AntiWindup, double dt)
+{
+  int i;
+  // kd allways 0 (using only pi controller here)
+  double kd = 0.0; // nur pi regler d-anteil ausblenden
 
-    last_el = el; // last e
-  }
+  w.int_e *= AntiWindup;
+  w.last_v_ist *= AntiWindup;
 
   // filtern: grosser aenderungen deuten auf fehlerhafte messungen hin
-  if (fabs(_v_r_ist - last_v_r_ist) < 0.19)
+  if (fabs(v_ist - w.last_v_ist) < 0.19)
   {
     // filter glaettung werte speichern
-    v_r_list[vr_index] = _v_r_ist;
-    f_v_r_ist = (v_r_list[vr_index] + v_r_list[vr_index - 1] + v_r_list[vr_index - 2] + v_r_list[vr_index - 3]) / 4.0;
-    vr_index++; // achtung auf ueberlauf
-    if (vr_index >= MAX_V_LIST)
+    w.v_list[w.index] = v_ist;
+    w.f_v_ist = (w.v_list[w.index] + w.v_list[w.index - 1] + w.v_list[w.index - 2] + w.v_list[w.index - 3]) / 4.0;
+    w.index++; // achtung auf ueberlauf
+    if (w.index >= MAX_V_LIST)
     {
-      vr_index = 3; // zum schutz vor ueberlauf kopieren bei hold einen mehr kopieren
+      w.index = 3; // zum schutz vor ueberlauf kopieren bei hold einen mehr kopieren
       for (i = 0; i < 3; i++)
-      {
-        v_r_list[2 - i] = v_r_list[MAX_V_LIST - i - 1];
-      }
+        w.v_list[2 - i] = w.v_list[MAX_V_LIST - i - 1];
     }
 
-    er = _v_r_soll - f_v_r_ist;
-    der = (er - last_er) / dt;
-    int_er += er * dt;
+    w.e = v_soll - w.f_v_ist;
+    w.de = (w.e - w.last_e) / dt;
+    w.int_e += w.e * dt;
 
-    zr = kp_r * er + kd_r * der + ki_r * int_er + _v_r_soll + turn_feedforward_r;
+    w.z = kp * w.e + kd * w.de + ki * w.int_e + v_soll + feedforward;
 
-    last_er = er; // last e
+    w.last_e = w.e; // last e
   }
 
   // range check und antiwindup stellgroessenbeschraenkung
   // verhindern das der integrier weiter hochlaeuft
   // deshalb die vorher addierten werte wieder abziehen
-  if (zl > vmax_)
+  if (w.z > vmax_)
   {
-    zl = vmax_;
-    int_el -= el * dt;
+    w.z = vmax_;
+    w.int_e -= w.e * dt;
   }
-  if (zr > vmax_)
+  if (w.z < -vmax_)
   {
-    zr = vmax_;
-    int_er -= er * dt;
-  }
-  if (zl < -vmax_)
-  {
-    zl = -vmax_;
-    int_el -= el * dt;
-  }
-  if (zr < -vmax_)
-  {
-    zr = -vmax_;
-    int_er -= er * dt;
+    w.z = -vmax_;
+    w.int_e -= w.e * dt;
   }
 
   // reduzieren
 
-  double step_max = vmax_ * 0.5;
+  // scaled with dt so the slope stays the same at any control rate
+  double step_max = vmax_ * 0.5 * dt / CONTROL_PERIOD;
   /* kraft begrenzung damit die Kette nicht springt bzw
      der Motor ein wenig entlastet wird. bei vorgabe von max
      geschwindigkeit braucht es so 5 * 10 ms bevor die Maximale
      Kraft anliegt */
-  if ((zl - last_zl) > step_max)
+  if ((w.z - w.last_z) > step_max)
   {
-    zl = last_zl + step_max;
+    w.z = w.last_z + step_max;
   }
-  if ((zl - last_zl) < -step_max)
+  if ((w.z - w.last_z) < -step_max)
   {
-    zl = last_zl - step_max;
+    w.z = w.last_z - step_max;
   }
-  if ((zr - last_zr) > step_max)
+
+  // store old val for deviation plotting
+  w.last_v_ist = v_ist;
+  w.last_z = w.z;
+
+  return w.z;
+}
+
+// learns the speed table on the ground the robot drives on: once setpoint
+// and speed have been steady for ADAPT_STEADY, the pwm the controller needs
+// for v_soll (the one of its output z) differs from the table's pwm for
+// v_soll by the integral's share. The offset of v_soll's bin moves towards
+// it by ADAPT_GAIN of that difference, at most ADAPT_STEP every
+// ADAPT_INTERVAL and ADAPT_MAX in total; the integral then unwinds by itself.
+void Kurt::adapt_feedforward(WheelControl &w, double *adapt, const int *pwm_v,
+    double v_soll, double z, double dt)
+{
+  bool steady = fabs(v_soll) >= ADAPT_V_MIN && fabs(v_soll - w.last_v_soll) < 0.001 &&
+    fabs(w.e) < ADAPT_E_MAX && fabs(z) < vmax_ && (z > 0.0) == (v_soll > 0.0);
+  w.last_v_soll = v_soll;
+  if (!steady)
   {
-    zr = last_zr + step_max;
+    w.steady = 0.0;
+    return;
   }
-  if ((zr - last_zr) < -step_max)
+
+  w.steady += dt;
+  if (w.steady < ADAPT_STEADY)
+    return;
+  w.steady -= ADAPT_INTERVAL;
+
+  int bin = std::min(ADAPT_BINS - 1, (int)(fabs(v_soll) / vmax_ * ADAPT_BINS));
+  double step = ADAPT_GAIN * (feedforward(pwm_v, adapt, z) - feedforward(pwm_v, adapt, v_soll));
+  step = std::max(-ADAPT_STEP, std::min(ADAPT_STEP, step));
+  adapt[bin] = std::max(-ADAPT_MAX, std::min(ADAPT_MAX, adapt[bin] + step));
+}
+
+// pid geschwindigkeits regler fuers linke und rechte rad
+// omega wird benoetig um die integration fuer den darunterstehenden regler
+// zu berechnen
+// dt ist das regelintervall wie bei control_wheel
+bool Kurt::set_wheel_speed2(double _v_l_soll, double _v_r_soll, double _v_l_ist,
+    double _v_r_ist, double _omega, double _AntiWindup, double dt)
+{
+  double turn_feedforward_l = -_omega / M_PI * feedforward_turn_;
+  double turn_feedforward_r = _omega / M_PI * feedforward_turn_;
+
+  double zl = control_wheel(wheel_l_, _v_l_soll, _v_l_ist, kp_l, ki_l, turn_feedforward_l, _AntiWindup, dt);
+  double zr = control_wheel(wheel_r_, _v_r_soll, _v_r_ist, kp_r, ki_r, turn_feedforward_r, _AntiWindup, dt);
+
+  if (leerlauf_learn_)
   {
-    zr = last_zr - step_max;
+    adapt_feedforward(wheel_l_, leerlauf_adapt_l_, pwm_v_l_, _v_l_soll, zl, dt);
+    adapt_feedforward(wheel_r_, leerlauf_adapt_r_, pwm_v_r_, _v_r_soll, zr, dt);
   }
 
-  // store old val for deviation plotting
-  last_v_l_ist = _v_l_ist;
-  last_v_r_ist = _v_r_ist;
-  last_zl = zl;
-  last_zr = zr;
-
-  set_wheel_speed1(zl, zr, 0, 0);
+  return set_wheel_speed1(zl, zr, 0, 0);
 }
 
-void Kurt::set_wheel_speed2_mc(double _v_l_soll, double _v_r_soll, double _omega,
-    double _AntiWindup)
+// returns whether a CAN_CONTROL frame was queued, false for unchanged
+// setpoints left to the keepalive
+bool Kurt::set_wheel_speed2_mc(double _v_l_soll, double _v_r_soll, double _omega,
+    double _AntiWindup, double stamp)
 {
   // divisor for floating points; will only send integer values ([+-]32e3) to Kurt
   const long factor = 100;
@@ -303,27 +309,152 @@ void Kurt::set_wheel_speed2_mc(double _v_l_soll, double _v_r_soll, double _omega
   frame.data[6] = omega >> 8;
   frame.data[7] = omega;
 
-  if(!can_.send_frame(&frame))
+  bool changed = !control_sent_ || memcmp(frame.data, control_frame_.data, sizeof(frame.data)) != 0;
+
+  if (use_bcm_)
   {
-    ROS_ERROR("set_wheel_speed2_mc: Error sending speed");
+    // the kernel repeats the frame every control_keepalive_ s, only changes
+    // are passed on (and sent at once)
+    if (!changed && bcm_active_)
+    {
+      control_skipped_++;
+      return false;
+    }
+    if (!can_.set_periodic_frame(&frame, control_keepalive_))
+    {
+      ROS_ERROR("set_wheel_speed2_mc: Error setting up periodic speed");
+      return false;
+    }
+    bcm_active_ = true;
+  }
+  else
+  {
+    // unchanged frames only as keepalive, at the control tick closest to it
+    if (!changed && stamp - control_stamp_ < control_keepalive_ - 0.5 * control_period_)
+    {
+      control_skipped_++;
+      return false;
+    }
+    if(!can_.send_frame(&frame))
+    {
+      ROS_ERROR("set_wheel_speed2_mc: Error sending speed");
+      return false;
+    }
+    control_stamp_ = stamp;
+  }
+
+  control_frame_ = frame;
+  control_sent_ = true;
+  control_frames_++;
+  return true;
+}
+
+void Kurt::setControlKeepalive(double keepalive)
+{
+  // half the watchdog leaves room for one lost frame
+  if (keepalive > 0.5 * CONTROL_WATCHDOG)
+  {
+    ROS_WARN("control_keepalive %g s too long for the %g s watchdog of the C167", keepalive, CONTROL_WATCHDOG);
+    keepalive = 0.5 * CONTROL_WATCHDOG;
   }
+  control_keepalive_ = std::max(keepalive, CONTROL_PERIOD);
 }
 
-void Kurt::set_wheel_speed(double _v_l_soll, double _v_r_soll, double _AntiWindup)
+void Kurt::set_wheel_speed(double _v_l_soll, double _v_r_soll, double _AntiWindup, double stamp)
 {
+  // measured interval since the last update; late ticks integrate their
+  // full interval, after a longer gap the controller starts with the nominal one
+  double dt = stamp - last_control_stamp_;
+  if (last_control_stamp_ == 0.0 || dt <= 0.0 || dt > CONTROL_DT_MAX)
+    dt = control_period_;
+  last_control_stamp_ = stamp;
+
+  bool sent;
   if (use_microcontroller_)
   {
     //Disable AntiWindup for now as the Kurt micro controller crashes when
     //going from zero to full speed with it activated
-    set_wheel_speed2_mc(_v_l_soll, _v_r_soll, 0, 1.0);
+    sent = set_wheel_speed2_mc(_v_l_soll, _v_r_soll, 0, 1.0, stamp);
   }
   else
   {
-    set_wheel_speed2(_v_l_soll, _v_r_soll, v_encoder_left_, v_encoder_right_, 0, _AntiWindup);
+    sent = set_wheel_speed2(_v_l_soll, _v_r_soll, v_encoder_left_, v_encoder_right_, 0, _AntiWindup, dt);
+  }
+
+  // from the encoder frame to the CAN_CONTROL frame that reacts to it, not
+  // counted if no frame went out; receive time stamps are CLOCK_REALTIME
+  if (speed_sample_ && sent)
+  {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    stats_.control_latency.add(now.tv_sec + now.tv_nsec * 1e-9 - speed_sample_stamp_);
   }
+  speed_sample_ = false;
 }
 
 // reads init data from pmw to speed experiment
+bool Kurt::setFeedForwardAdaptation(const std::string &filename)
+{
+  if (use_microcontroller_)
+  {
+    ROS_ERROR("Feedforward adaptation needs a speedtable");
+    return false;
+  }
+  if (!load_feedforward_adaptation(filename))
+    return false;
+  leerlauf_file_ = filename;
+  leerlauf_learn_ = true;
+  return true;
+}
+
+// one line per speed bin: upper speed of the bin in m/s, offsets of the left
+// and right wheel in pwm; a missing file starts with a zero offset
+bool Kurt::load_feedforward_adaptation(const std::string &filename)
+{
+  FILE *fp = fopen(filename.c_str(), "r");
+  if (fp == NULL)
+  {
+    ROS_INFO("No feedforward adaptation in %s, starting from the speedtable", filename.c_str());
+    return true;
+  }
+
+  double v, adapt_l[ADAPT_BINS], adapt_r[ADAPT_BINS];
+  int i;
+  for (i = 0; i < ADAPT_BINS; i++)
+  {
+    if (fscanf(fp, "%lf %lf %lf", &v, &adapt_l[i], &adapt_r[i]) != 3)
+      break;
+  }
+  fclose(fp);
+  if (i < ADAPT_BINS)
+  {
+    ROS_ERROR("ERROR reading feedforward adaptation %s.", filename.c_str());
+    return false;
+  }
+
+  for (i = 0; i < ADAPT_BINS; i++)
+  {
+    leerlauf_adapt_l_[i] = std::max(-ADAPT_MAX, std::min(ADAPT_MAX, adapt_l[i]));
+    leerlauf_adapt_r_[i] = std::max(-ADAPT_MAX, std::min(ADAPT_MAX, adapt_r[i]));
+  }
+  ROS_INFO("Feedforward adaptation loaded from %s", filename.c_str());
+  return true;
+}
+
+bool Kurt::save_feedforward_adaptation(const std::string &filename) const
+{
+  FILE *fp = fopen(filename.c_str(), "w");
+  if (fp == NULL)
+  {
+    ROS_ERROR("ERROR saving feedforward adaptation to %s.", filename.c_str());
+    return false;
+  }
+  for (int i = 0; i < ADAPT_BINS; i++)
+    fprintf(fp, "%.4f %.2f %.2f\n", vmax_ * (i + 1) / ADAPT_BINS, leerlauf_adapt_l_[i], leerlauf_adapt_r_[i]);
+  fclose(fp);
+  return true;
+}
+
 bool Kurt::read_speed_to_pwm_leerlauf_tabelle(const std::string &filename, int *nr, double **v_pwm_l, double **v_pwm_r)
 {
   int i;
@@ -415,10 +546,11 @@ void Kurt::make_pwm_v_tab(int nr, double *v_pwm_l, double *v_pwm_r, int nr_v, in
   }
 }
 
-void Kurt::odometry(int wheel_a, int wheel_b)
+// wheel_a, wheel_b: ticks covered in the last time_diff seconds
+void Kurt::odometry(double stamp, double time_diff, int wheel_a, int wheel_b)
 {
-  // time_diff in sec; we hope kurt is precise ?? !! and sends every 10 ms
-  double time_diff = 0.01;
+  speed_sample_ = true;
+  speed_sample_stamp_ = stamp;
 
   // covered distance of wheels in meter
   double wheel_L = wheel_perimeter_ * wheel_a / ticks_per_turn_of_wheel_;
@@ -431,48 +563,11 @@ void Kurt::odometry(int wheel_a, int wheel_b)
   // angular velocity in rad/s
   double v_encoder_angular = (v_encoder_right_ - v_encoder_left_) / axis_length_ * turning_adaptation_;
 
-  // calc position deltas
-  double local_dx, local_dz, dtheta_y = 0.0;
-  const double EPSILON = 0.0001;
+  // Odometrie: Bogen aus den Tick-Summen, in Weltkoordinaten
+  encoder_odometry_.add(wheel_a, wheel_b);
 
-  if (fabs(wheel_L - wheel_R) < EPSILON)
-  {
-    if (fabs(wheel_L) < EPSILON)
-    {
-      local_dx = 0.0;
-      local_dz = 0.0;
-    }
-    else // beide fast gleich (wheel_distance_a == wheel_distance_b)
-    {
-      local_dx = 0.0;
-      local_dz = (wheel_L + wheel_R) * 0.5;
-    }
-  }
-  else // (wheel_distance_a != wheel_distance_b) and > 0
-  {
-    double hypothenuse = 0.5 * (wheel_L + wheel_R);
-
-    dtheta_y = (wheel_L - wheel_R) / axis_length_ * turning_adaptation_;
-
-    local_dx = hypothenuse * sin(dtheta_y);
-    local_dz = hypothenuse * cos(dtheta_y);
-  }
-
-  // Odometrie : Koordinatentransformation in Weltkoordinaten
-  static double x_from_encoder = 0.0;
-  static double z_from_encoder = 0.0;
-  static double theta_from_encoder = 0.0;
-
-  x_from_encoder += local_dx * cos(theta_from_encoder) + local_dz * sin(theta_from_encoder);
-  z_from_encoder += -local_dx * sin(theta_from_encoder) + local_dz * cos(theta_from_encoder);
-
-  theta_from_encoder += dtheta_y;
-  if (theta_from_encoder > M_PI)
-    theta_from_encoder -= 2.0 * M_PI;
-  if (theta_from_encoder < -M_PI)
-    theta_from_encoder += 2.0 * M_PI;
-
-  comm_.send_odometry(z_from_encoder, x_from_encoder, theta_from_encoder, v_encoder, v_encoder_angular, wheel_a, wheel_b, v_encoder_left_, v_encoder_right_);
+  comm_.send_odometry(stamp, encoder_odometry_.z(), encoder_odometry_.x(), encoder_odometry_.theta(),
+      v_encoder, v_encoder_angular, wheel_a, wheel_b, v_encoder_left_, v_encoder_right_);
 }
 
 ////////////////// rotunit //////////////////////////////////////
@@ -495,91 +590,104 @@ void Kurt::can_rotunit_send(double speed)
   if(!can_.send_frame(&frame))
   {
     ROS_ERROR("can_rotunit_send: Error sending rotunit speed");
+    return;
   }
-  else
+
+  // CAN_GETROTUNIT only while the rotunit turns
+  bool on = speed != 0.0;
+  if (on != use_rotunit_)
   {
-    use_rotunit_ = true;
+    use_rotunit_ = on;
+    update_can_filter();
   }
 }
 
-void Kurt::can_rotunit(const can_frame &frame)
+void Kurt::can_rotunit(const int64_t *v, double stamp)
 {
-  int rot = (frame.data[1] << 8) + frame.data[2];
+  int rot = v[0];
   double rot2 = rot * 2 * M_PI / 10240;
-  comm_.send_rotunit(rot2);
+  comm_.send_rotunit(stamp, rot2);
 }
 
 //////////////////// Kurt Sensor ////////////////////////////////
 
-void Kurt::can_encoder(const can_frame &frame)
+void Kurt::can_encoder(const int64_t *v, double stamp)
 {
-  int left_encoder = 0, right_encoder = 0;
-  if (frame.data[0] & 0x80) // negative Zahl auf 15 Bit genau
-    left_encoder = (frame.data[0] << 8) + frame.data[1]-65536;
-  else
-    left_encoder = (frame.data[0] << 8) + frame.data[1];
-
-  if (frame.data[2] & 0x80) // negative Zahl auf 15 Bit genau
-    right_encoder = (frame.data[2] << 8) + frame.data[3]-65536;
-  else
-    right_encoder = (frame.data[2] << 8) + frame.data[3];
-
-  odometry(left_encoder, right_encoder);
+  // time_diff in sec from the kernel receive time stamps; the nominal period
+  // is used for the first frame and for implausible intervals (lost frames,
+  // clock jumps)
+  double time_diff = stamp - last_encoder_stamp_;
+  if (last_encoder_stamp_ == 0.0 || time_diff < 0.5 * ENCODER_PERIOD || time_diff > 1.5 * ENCODER_PERIOD)
+    time_diff = ENCODER_PERIOD;
+  last_encoder_stamp_ = stamp;
+
+  // negative Zahlen auf 16 Bit, vom Layout schon vorzeichenerweitert
+  odometry(stamp, time_diff, v[0], v[1]);
 }
 
-int Kurt::normalize_ir(int ir)
+// the accumulated counts already contain the ticks of lost frames, so a gap
+// only makes the interval longer and no distance is lost
+void Kurt::can_getspeed(const int64_t *v, double stamp)
 {
-  if (ir < IR_MIN * 1000 || ir > IR_MAX * 1000) // convert m --> mm
-  {
-    return -1;
-  }
-  return (int)(pow(30000.0 / ((double)ir - 10.0), 1.0 / 1.4) - 10.0);
-}
+  uint32_t left = v[0], right = v[1];
 
-int Kurt::normalize_sonar(int s)
-{
-  if (s < SONAR_MIN * 1000 || s > SONAR_MAX * 1000) // convert m --> mm
+  if (!getspeed_valid_)
   {
-    return -1;
+    getspeed_left_ = left;
+    getspeed_right_ = right;
+    last_getspeed_stamp_ = stamp;
+    getspeed_valid_ = true;
+    return;
   }
-  return (int)((double)s * 0.110652 + 11.9231);
+
+  // differences modulo 2^32 stay correct when the counters overflow
+  int wheel_a = (int32_t)(left - getspeed_left_);
+  int wheel_b = (int32_t)(right - getspeed_right_);
+  getspeed_left_ = left;
+  getspeed_right_ = right;
+
+  double time_diff = stamp - last_getspeed_stamp_;
+  last_getspeed_stamp_ = stamp;
+  if (time_diff > 1.5 * GETSPEED_PERIOD)
+    odometry_bridged_ += lround(time_diff / GETSPEED_PERIOD) - 1;
+  else if (time_diff < 0.5 * GETSPEED_PERIOD)
+    time_diff = GETSPEED_PERIOD;
+
+  odometry(stamp, time_diff, wheel_a, wheel_b);
 }
 
-void Kurt::can_sonar8_9(const can_frame &frame)
+void Kurt::can_sonar8_9(const int64_t *v, double stamp)
 {
-  int sonar1 = normalize_ir((frame.data[2] << 8) + frame.data[3]);
+  int sonar1 = sensor_tables_.ir(v[0]);
 
-  comm_.send_sonar_leftBack(sonar1);
+  comm_.send_sonar_leftBack(stamp, sonar1);
 }
 
-void Kurt::can_sonar4_7(const can_frame &frame)
+void Kurt::can_sonar4_7(const int64_t *v, double stamp)
 {
-  int sonar0 = normalize_ir((frame.data[0] << 8) + frame.data[1]);
-  int sonar1 = normalize_sonar((frame.data[2] << 8) + frame.data[3]);
-  int sonar2 = normalize_ir((frame.data[4] << 8) + frame.data[5]);
-  int sonar3 = normalize_ir((frame.data[6] << 8) + frame.data[7]);
+  static const SensorChannel channels[4] = { SENSOR_IR, SENSOR_SONAR, SENSOR_IR, SENSOR_IR };
+  int sonar[4];
+  sensor_tables_.normalize_frame(v, channels, 4, sonar);
 
-  comm_.send_sonar_front_usound_leftFront_left(sonar0, sonar1, sonar2, sonar3);
+  comm_.send_sonar_front_usound_leftFront_left(stamp, sonar[0], sonar[1], sonar[2], sonar[3]);
 }
 
-void Kurt::can_sonar0_3(const can_frame &frame)
+void Kurt::can_sonar0_3(const int64_t *v, double stamp)
 {
-  int sonar0 = normalize_ir((frame.data[0] << 8) + frame.data[1]);
-  int sonar1 = normalize_ir((frame.data[2] << 8) + frame.data[3]);
-  int sonar2 = normalize_ir((frame.data[4] << 8) + frame.data[5]);
+  static const SensorChannel channels[3] = { SENSOR_IR, SENSOR_IR, SENSOR_IR };
+  int sonar[3];
+  sensor_tables_.normalize_frame(v, channels, 3, sonar);
 
-  comm_.send_sonar_back_rightBack_rightFront(sonar0, sonar1, sonar2);
+  comm_.send_sonar_back_rightBack_rightFront(stamp, sonar[0], sonar[1], sonar[2]);
 }
 
-void Kurt::can_tilt_comp(const can_frame &frame)
+void Kurt::can_tilt_comp(const int64_t *v, double stamp)
 {
   double a0, a1;
   unsigned int t0, t1;
 
-  t0 = (frame.data[0] << 8) + (frame.data[1]);
-  t1 = (frame.data[2] << 8) + (frame.data[3]);
-  //int comp1 = (frame.data[4] << 8) + frame.data[5];
-  //int comp2 = (frame.data[6] << 8) + frame.data[7];
+  t0 = v[0];
+  t1 = v[1];
 
   // calculate g values (offset and sensitivity correction)
   a0 = ((double)t0 - 32768.0) / 3932.0;
@@ -591,114 +699,297 @@ void Kurt::can_tilt_comp(const can_frame &frame)
 
   double roll = tilt_lr * 180.0 / M_PI;
   double pitch = tilt_fb * 180.0 / M_PI;
-  comm_.send_pitch_roll(pitch, roll);
+  comm_.send_pitch_roll(stamp, pitch, roll);
 }
 
-void Kurt::can_gyro_mc1(const can_frame &frame)
+static double wrap_angle(double theta)
 {
-  static int gyro_offset_read = 0;
-  static double offset, delta; // initial offset
-  signed long gyro_raw;
+  if (theta >  M_PI) theta -= 2.0 * M_PI;
+  if (theta < -M_PI) theta += 2.0 * M_PI;
+  return theta;
+}
 
-  gyro_raw = (frame.data[0] << 24) + (frame.data[1] << 16)
-    + (frame.data[2] << 8)  + (frame.data[3]);
-  double theta = (double)gyro_raw / 4992511.0 * M_PI / 180.0;
+// decodes a gyro frame into gyro.theta and gyro.sigma, false while the
+// gyro is not stable yet
+bool Kurt::gyro_update(Gyro &gyro, const int64_t *v, double stamp)
+{
+  double theta = (double)v[0] / 4992511.0 * M_PI / 180.0;
 
-  double sigma_deg = (double)((frame.data[4] << 24) + (frame.data[5] << 16)
-      + (frame.data[6] << 8)  + (frame.data[7])) / 10000;
+  double sigma_deg = (double)v[1] / 10000;
 
   double tmp = (sqrt(sigma_deg) * M_PI / 180.0);
   double sigma = tmp * tmp;
 
   // wait until gyro is stable
-  if (gyro_offset_read++ < 100)
+  if (gyro.offset_read++ < 100)
+    return false;
+
+  if(gyro.offset_read == 100)
+  {
+    gyro.offset = theta;
+    gyro.delta = wrap_angle(gyro.offset / 100.0);
+  }
+
+  gyro.offset = wrap_angle(gyro.offset + gyro.delta);
+
+  gyro.theta = wrap_angle(theta - gyro.offset);
+  gyro.sigma = sigma;
+  gyro.stamp = stamp;
+  gyro.valid = true;
+  gyro.pending = true;
+  return true;
+}
+
+void Kurt::can_gyro_mc1(const int64_t *v, double stamp)
+{
+  if (!gyro_update(gyro_[0], v, stamp))
+    return;
+
+  if (use_gyro_mc2_)
+    gyro_fuse(stamp);
+  else
+    comm_.send_gyro(stamp, gyro_[0].theta, gyro_[0].sigma);
+}
+
+void Kurt::can_gyro_mc2(const int64_t *v, double stamp)
+{
+  if (gyro_update(gyro_[1], v, stamp))
+    gyro_fuse(stamp);
+}
+
+// heading change of gyro since it last went into the fused heading
+double Kurt::gyro_step(Gyro &gyro)
+{
+  double step = gyro.fused ? wrap_angle(gyro.theta - gyro.fused_theta) : 0.0;
+  gyro.fused_theta = gyro.theta;
+  gyro.fused = true;
+  gyro.pending = false;
+  return step;
+}
+
+// publishes the heading once both gyros have a new sample. It advances by
+// the inverse variance weighted mean of the heading changes of both gyros
+// if they agree, otherwise by the change of the one with the lower sigma.
+// Only the changes since the last fused sample are compared, so their
+// relative drift does not matter and the fusion goes on as soon as they
+// agree again. A gyro silent for GYRO_FRESH is left out, the other one
+// then drives the heading alone.
+void Kurt::gyro_fuse(double stamp)
+{
+  Gyro &g1 = gyro_[0], &g2 = gyro_[1];
+
+  if (!gyro_started_)
+  {
+    gyro_theta_ = g1.pending ? g1.theta : g2.theta;
+    gyro_started_ = true;
+  }
+
+  if (!g1.pending || !g2.pending)
+  {
+    Gyro *single = NULL;
+    if (g1.pending && (!g2.valid || stamp - g2.stamp > GYRO_FRESH))
+      single = &g1;
+    else if (g2.pending && (!g1.valid || stamp - g1.stamp > GYRO_FRESH))
+      single = &g2;
+    // otherwise wait for the sample of the other gyro
+    if (single == NULL)
+      return;
+    gyro_theta_ = wrap_angle(gyro_theta_ + gyro_step(*single));
+    comm_.send_gyro(stamp, gyro_theta_, single->sigma);
     return;
+  }
 
-  if(gyro_offset_read == 100)
+  // a gyro that joins has no change of its own yet
+  bool joined1 = !g1.fused, joined2 = !g2.fused;
+  double d1 = gyro_step(g1), d2 = gyro_step(g2);
+  if (joined1)
+    d1 = d2;
+  if (joined2)
+    d2 = d1;
+  double e = wrap_angle(d2 - d1);
+  double gate = std::max(GYRO_GATE * sqrt(g1.sigma + g2.sigma), GYRO_GATE_MIN);
+  double step, sigma;
+  if (fabs(e) > gate)
+  {
+    if (!gyro_disagree_)
+      ROS_WARN("gyro_fuse: Gyros disagree by %.2f deg", e * 180.0 / M_PI);
+    gyro_disagree_ = true;
+    gyro_disagreements_++;
+    step = g1.sigma <= g2.sigma ? d1 : d2;
+    sigma = std::min(g1.sigma, g2.sigma);
+  }
+  else
   {
-    offset = theta;
-    delta = offset / 100.0;
-    if (delta >  M_PI) delta -= 2.0 * M_PI;
-    if (delta < -M_PI) delta += 2.0 * M_PI;
+    gyro_disagree_ = false;
+    double sum = g1.sigma + g2.sigma;
+    double w2 = sum > 0.0 ? g1.sigma / sum : 0.5;
+    step = d1 + w2 * e;
+    sigma = sum > 0.0 ? g1.sigma * g2.sigma / sum : 0.0;
   }
+  gyro_theta_ = wrap_angle(gyro_theta_ + step);
+  comm_.send_gyro(stamp, gyro_theta_, sigma);
+}
 
-  offset += delta;
-  if (offset >  M_PI) offset -= 2.0 * M_PI;
-  if (offset < -M_PI) offset += 2.0 * M_PI;
+void Kurt::setGyroFusion(bool use_gyro_mc2)
+{
+  use_gyro_mc2_ = use_gyro_mc2;
+  update_can_filter();
+}
 
-  theta -= offset;
+// forgets everything learned from earlier frames and commands: controller
+// state, odometry pose, the last encoder counts and the gyro offsets, and
+// the state of the Comm
+void Kurt::reset()
+{
+  wheel_l_.reset();
+  wheel_r_.reset();
+
+  v_encoder_left_ = v_encoder_right_ = 0.0;
+  last_encoder_stamp_ = 0.0;
+  last_control_stamp_ = 0.0;
+  control_sent_ = false;
+  speed_sample_ = false;
+  encoder_odometry_.reset();
+  getspeed_valid_ = false;
+
+  gyro_[0] = gyro_[1] = Gyro();
+  gyro_started_ = false;
+  gyro_theta_ = 0.0;
+  gyro_disagree_ = false;
+
+  comm_.reset();
+}
 
-  if (theta >  M_PI) theta -= 2.0 * M_PI;
-  if (theta < -M_PI) theta += 2.0 * M_PI;
+void Kurt::setGetSpeedOdometry(bool use_getspeed)
+{
+  use_getspeed_ = use_getspeed;
+  getspeed_valid_ = false;
+  update_can_filter();
+}
+
+void Kurt::snapshot_stats(CANStats *stats) const
+{
+  *stats = stats_;
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  stats->stamp = now.tv_sec + now.tv_nsec * 1e-9;
+  stats->tx_coalesced = can_.coalesced_frames();
+  stats->tx_dropped = can_.dropped_frames();
+  stats->odometry_bridged = odometry_bridged_;
+  stats->gyro_disagreements = gyro_disagreements_;
+  stats->control_frames = control_frames_;
+  stats->control_skipped = control_skipped_;
+}
 
-  comm_.send_gyro(theta, sigma);
+template <typename Layout, void (Kurt::*Handler)(const int64_t *v, double stamp)>
+void Kurt::decode(const can_frame &frame, double stamp)
+{
+  int64_t v[Layout::nr];
+  Layout::decode(frame, v);
+  (this->*Handler)(v, stamp);
+}
+
+// constant initialized, new IDs only need their layout and handler here
+const Kurt::DecoderEntry Kurt::decoders_[CAN_DECODER_IDS] = {
+  /* 0x00 */ { 0, NULL },
+  /* 0x01 CAN_CONTROL */ { 0, NULL },
+  /* 0x02 */ { 0, NULL },
+  /* 0x03 */ { 0, NULL },
+  /* 0x04 CAN_INFO_1 */ { 0, NULL },
+  /* 0x05 CAN_ADC00_03 */ { ADC00_03Layout::min_dlc, &Kurt::decode<ADC00_03Layout, &Kurt::can_sonar0_3> },
+  /* 0x06 CAN_ADC04_07 */ { ADC04_07Layout::min_dlc, &Kurt::decode<ADC04_07Layout, &Kurt::can_sonar4_7> },
+  /* 0x07 CAN_ADC08_11 */ { ADC08_11Layout::min_dlc, &Kurt::decode<ADC08_11Layout, &Kurt::can_sonar8_9> },
+  /* 0x08 CAN_ADC12_15 */ { 0, NULL },
+  /* 0x09 CAN_ENCODER */ { EncoderLayout::min_dlc, &Kurt::decode<EncoderLayout, &Kurt::can_encoder> },
+  /* 0x0A CAN_BUMPERC */ { 0, NULL },
+  /* 0x0B CAN_DEADRECK */ { 0, NULL },
+  /* 0x0C CAN_GETSPEED */ { GetSpeedLayout::min_dlc, &Kurt::decode<GetSpeedLayout, &Kurt::can_getspeed> },
+  /* 0x0D CAN_TILT_COMP */ { TiltLayout::min_dlc, &Kurt::decode<TiltLayout, &Kurt::can_tilt_comp> },
+  /* 0x0E CAN_GYRO_MC1 */ { GyroLayout::min_dlc, &Kurt::decode<GyroLayout, &Kurt::can_gyro_mc1> },
+  /* 0x0F */ { 0, NULL },
+  /* 0x10 CAN_GETROTUNIT */ { RotunitLayout::min_dlc, &Kurt::decode<RotunitLayout, &Kurt::can_rotunit> },
+  /* 0x11 */ { 0, NULL },
+  /* 0x12 */ { 0, NULL },
+  /* 0x13 */ { 0, NULL },
+  /* 0x14 */ { 0, NULL },
+  /* 0x15 CAN_BDC00_03 */ { 0, NULL },
+  /* 0x16 CAN_BDC04_07 */ { 0, NULL },
+  /* 0x17 CAN_BDC08_11 */ { 0, NULL },
+  /* 0x18 CAN_BDC12_15 */ { 0, NULL },
+  /* 0x19 */ { 0, NULL },
+  /* 0x1A */ { 0, NULL },
+  /* 0x1B */ { 0, NULL },
+  /* 0x1C */ { 0, NULL },
+  /* 0x1D */ { 0, NULL },
+  /* 0x1E CAN_GYRO_MC2 */ { GyroLayout::min_dlc, &Kurt::decode<GyroLayout, &Kurt::can_gyro_mc2> },
+  /* 0x1F */ { 0, NULL },
+};
+
+// the kernel drops every frame that has no decoder in decoders_
+void Kurt::update_can_filter()
+{
+  canid_t ids[CAN_MAX_FILTER];
+  size_t nr = 0;
+
+  for (canid_t id = 0; id < CAN_DECODER_IDS; id++)
+  {
+    if (decoders_[id].decode == NULL)
+      continue;
+    if (id == CAN_GETROTUNIT && !use_rotunit_)
+      continue;
+    if (id == CAN_GYRO_MC2 && !use_gyro_mc2_)
+      continue;
+    // only one of the odometry sources
+    if (id == (use_getspeed_ ? CAN_ENCODER : CAN_GETSPEED))
+      continue;
+    ids[nr++] = id;
+  }
+
+  can_.set_filter(ids, nr);
+}
+
+void Kurt::can_dispatch(const can_frame &frame, double stamp)
+{
+  canid_t id = frame.can_id;
+  if (id >= CAN_DECODER_IDS || decoders_[id].decode == NULL)
+  {
+    stats_.unknown();
+    return;
+  }
+
+  stats_.frame(id, stamp);
+  if (frame.can_dlc < decoders_[id].min_dlc)
+  {
+    stats_.error(id);
+    return;
+  }
+
+  (this->*decoders_[id].decode)(frame, stamp);
 }
 
 int Kurt::can_read_fifo()
 {
   can_frame frame;
+  double stamp;
 
-  if(!can_.receive_frame(&frame))
+  if(!can_.receive_frame(&frame, &stamp))
     return -1;
 
-  switch (frame.can_id) {
-    case CAN_ADC00_03:
-      can_sonar0_3(frame);
-      break;
-    case CAN_ADC04_07:
-      can_sonar4_7(frame);
-      break;
-    case CAN_ADC08_11:
-      can_sonar8_9(frame);
-      break;
-    case CAN_ENCODER:
-      can_encoder(frame);
-      break;
-    case CAN_TILT_COMP:
-      can_tilt_comp(frame);
-      break;
-    case CAN_GYRO_MC1:
-      can_gyro_mc1(frame);
-      break;
-    case CAN_GETROTUNIT:
-      can_rotunit(frame);
-      break;
-    /*case CAN_CONTROL:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (control message)", frame.can_id);
-      break;
-    case CAN_INFO_1:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (info message)", frame.can_id);
-      break;
-    case CAN_ADC12_15:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (analog input channels: 12 - 15)", frame.can_id);
-      break;
-    case CAN_BUMPERC:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (bumpers and remote control)", frame.can_id);
-      break;
-    case CAN_BDC00_03:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (analog input channels: 0 - 3)", frame.can_id);
-      break;
-    case CAN_BDC04_07:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (analog input channels: 4 - 7)", frame.can_id);
-      break;
-    case CAN_BDC08_11:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (analog input channels: 8 - 11)", frame.can_id);
-      break;
-    case CAN_BDC12_15:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (analog input channels: 12 - 15)", frame.can_id);
-      break;
-    case CAN_GYRO_MC2:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (data from gyro connected to 2nd C167)", frame.can_id);
-      break;
-    case CAN_DEADRECK:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X (position (dead reckoning))", frame.can_id);
-      break;
-    case CAN_GETSPEED:
-      ROS_DEBUG("can_read_fifo: Unused CAN message ID: %X current transl. and rot. speed)", frame.can_id);
-      break;
-    default:
-      ROS_DEBUG("can_read_fifo: Unknown CAN ID: %X", frame.can_id);*/
-  }
+  can_dispatch(frame, stamp);
 
   return frame.can_id;
 }
+
+// decodes all frames queued in the socket at once, returns the number of
+// frames handled
+int Kurt::can_read_fifo_batch(bool wait)
+{
+  can_frame frames[CAN_BATCH_SIZE];
+  double stamps[CAN_BATCH_SIZE];
+
+  int nr = can_.receive_frames(frames, stamps, CAN_BATCH_SIZE, wait);
+  for (int i = 0; i < nr; i++)
+    can_dispatch(frames[i], stamps[i]);
+
+  return nr;
+}
@@ -1,7 +1,23 @@
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
 #include <string>
 
+#include <atomic>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
 #include <ros/ros.h>
 #include <ros/console.h>
+#include <ros/callback_queue.h>
 
 #include <geometry_msgs/Twist.h>
 #include <nav_msgs/Odometry.h>
@@ -10,9 +26,44 @@
 #include <sensor_msgs/JointState.h>
 #include <sensor_msgs/Imu.h>
 #include <sensor_msgs/Range.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 
+#include "canstats.h"
 #include "kurt.h"
 #include "comm.h"
+#include "queuecomm.h"
+#include "spsc_ring.h"
+
+// callback queue that signals an eventfd whenever a callback is added, so the
+// main loop can wait for ROS messages in the same epoll set as the CAN socket
+class EventCallbackQueue : public ros::CallbackQueue
+{
+  public:
+    EventCallbackQueue() : fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) { }
+    ~EventCallbackQueue() { close(fd_); }
+
+    virtual void addCallback(const ros::CallbackInterfacePtr &callback, uint64_t removal_id = 0)
+    {
+      ros::CallbackQueue::addCallback(callback, removal_id);
+      uint64_t one = 1;
+      if (write(fd_, &one, sizeof(one)) != sizeof(one))
+        ROS_WARN("EventCallbackQueue: Error signaling eventfd (%s)", strerror(errno));
+    }
+
+    // resets the eventfd and calls all queued callbacks
+    void callAvailable()
+    {
+      uint64_t count;
+      if (read(fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        ROS_WARN("EventCallbackQueue: Error reading eventfd (%s)", strerror(errno));
+      ros::CallbackQueue::callAvailable();
+    }
+
+    int fd() const { return fd_; }
+
+  private:
+    int fd_;
+};
 
 class ROSComm : public Comm
 {
@@ -33,23 +84,26 @@ class ROSComm : public Comm
       cov_y_theta_(cov_y_theta),
       ticks_per_turn_of_wheel_(ticks_per_turn_of_wheel),
       publish_tf_(false),
+      wheelpos_l_(0.0),
+      wheelpos_r_(0.0),
       odom_pub_(n_.advertise<nav_msgs::Odometry> ("odom", 10)),
       range_pub_(n_.advertise<sensor_msgs::Range> ("range", 10)),
       imu_pub_(n_.advertise<sensor_msgs::Imu> ("imu", 10)),
       joint_pub_(n_.advertise<sensor_msgs::JointState> ("joint_states", 1)) { }
-    virtual void send_odometry(double z, double x, double theta, double
+    virtual void send_odometry(double stamp, double z, double x, double theta, double
         v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double
         v_encoder_left, double v_encoder_right); virtual void
-      send_sonar_leftBack(int ir_left_back);
-    virtual void send_sonar_front_usound_leftFront_left(int ir_right_front, int
+      send_sonar_leftBack(double stamp, int ir_left_back);
+    virtual void send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int
         usound, int ir_left_front, int ir_left);
-    virtual void send_sonar_back_rightBack_rightFront(int ir_back, int
+    virtual void send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int
         ir_right_back, int ir_right);
-    virtual void send_pitch_roll(double pitch, double roll);
-    virtual void send_gyro(double theta, double sigma);
-    virtual void send_rotunit(double rot);
+    virtual void send_pitch_roll(double stamp, double pitch, double roll);
+    virtual void send_gyro(double stamp, double theta, double sigma);
+    virtual void send_rotunit(double stamp, double rot);
 
     void setTFPrefix(const std::string &tf_prefix);
+    virtual void reset() { wheelpos_l_ = wheelpos_r_ = 0.0; }
 
   private:
     void populateCovariance(nav_msgs::Odometry &msg, double v_encoder, double
@@ -60,6 +114,8 @@ class ROSComm : public Comm
     int ticks_per_turn_of_wheel_;
     bool publish_tf_;
     std::string tf_prefix_;
+    // wheel joint angles
+    double wheelpos_l_, wheelpos_r_;
 
     tf::TransformBroadcaster odom_broadcaster_;
     ros::Publisher odom_pub_;
@@ -125,13 +181,13 @@ void ROSComm::populateCovariance(nav_msgs::Odometry &msg, double v_encoder, doub
   }
 }
 
-void ROSComm::send_odometry(double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right)
+void ROSComm::send_odometry(double stamp, double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right)
 {
   nav_msgs::Odometry odom;
   odom.header.frame_id = tf::resolve(tf_prefix_, "odom_combined");
   odom.child_frame_id = tf::resolve(tf_prefix_, "base_footprint");
 
-  odom.header.stamp = ros::Time::now();
+  odom.header.stamp = ros::Time(stamp);
   odom.pose.pose.position.x = z;
   odom.pose.pose.position.y = -x;
   odom.pose.pose.position.z = 0.0;
@@ -150,7 +206,7 @@ void ROSComm::send_odometry(double z, double x, double theta, double v_encoder,
     odom_trans.header.frame_id = tf::resolve(tf_prefix_, "odom_combined");
     odom_trans.child_frame_id = tf::resolve(tf_prefix_, "base_footprint");
 
-    odom_trans.header.stamp = ros::Time::now();
+    odom_trans.header.stamp = ros::Time(stamp);
     odom_trans.transform.translation.x = z;
     odom_trans.transform.translation.y = -x;
     odom_trans.transform.translation.z = 0.0;
@@ -160,7 +216,7 @@ void ROSComm::send_odometry(double z, double x, double theta, double v_encoder,
   }
 
   sensor_msgs::JointState joint_state;
-  joint_state.header.stamp = ros::Time::now();
+  joint_state.header.stamp = ros::Time(stamp);
   joint_state.name.resize(6);
   joint_state.position.resize(6);
   joint_state.name[0] = "left_front_wheel_joint";
@@ -170,22 +226,20 @@ void ROSComm::send_odometry(double z, double x, double theta, double v_encoder,
   joint_state.name[4] = "right_middle_wheel_joint";
   joint_state.name[5] = "right_rear_wheel_joint";
 
-  static double wheelpos_l = 0;
-  wheelpos_l += 2.0 * M_PI * wheel_a / ticks_per_turn_of_wheel_;
-  if (wheelpos_l > M_PI)
-    wheelpos_l -= 2.0 * M_PI;
-  if (wheelpos_l < -M_PI)
-    wheelpos_l += 2.0 * M_PI;
+  wheelpos_l_ += 2.0 * M_PI * wheel_a / ticks_per_turn_of_wheel_;
+  if (wheelpos_l_ > M_PI)
+    wheelpos_l_ -= 2.0 * M_PI;
+  if (wheelpos_l_ < -M_PI)
+    wheelpos_l_ += 2.0 * M_PI;
 
-  static double wheelpos_r = 0;
-  wheelpos_r += 2 * M_PI * wheel_b / ticks_per_turn_of_wheel_;
-  if (wheelpos_r > M_PI)
-    wheelpos_r -= 2.0 * M_PI;
-  if (wheelpos_r < -M_PI)
-    wheelpos_r += 2.0 * M_PI;
+  wheelpos_r_ += 2 * M_PI * wheel_b / ticks_per_turn_of_wheel_;
+  if (wheelpos_r_ > M_PI)
+    wheelpos_r_ -= 2.0 * M_PI;
+  if (wheelpos_r_ < -M_PI)
+    wheelpos_r_ += 2.0 * M_PI;
 
-  joint_state.position[0] = joint_state.position[1] = joint_state.position[2] = wheelpos_l;
-  joint_state.position[3] = joint_state.position[4] = joint_state.position[5] = wheelpos_r;
+  joint_state.position[0] = joint_state.position[1] = joint_state.position[2] = wheelpos_l_;
+  joint_state.position[3] = joint_state.position[4] = joint_state.position[5] = wheelpos_r_;
 
   // note: we reuse joint_state here, i.e., we modify joint_state after publishing.
   // this is only safe as long as nothing in the same process subscribes to the
@@ -193,10 +247,10 @@ void ROSComm::send_odometry(double z, double x, double theta, double v_encoder,
   joint_pub_.publish(joint_state);
 }
 
-void ROSComm::send_sonar_leftBack(int ir_left_back)
+void ROSComm::send_sonar_leftBack(double stamp, int ir_left_back)
 {
   sensor_msgs::Range range;
-  range.header.stamp = ros::Time::now();
+  range.header.stamp = ros::Time(stamp);
 
   range.header.frame_id = tf::resolve(tf_prefix_, "ir_left_back");
   range.radiation_type = sensor_msgs::Range::INFRARED;
@@ -207,10 +261,10 @@ void ROSComm::send_sonar_leftBack(int ir_left_back)
   range_pub_.publish(range);
 }
 
-void ROSComm::send_sonar_front_usound_leftFront_left(int ir_right_front, int usound, int ir_left_front, int ir_left)
+void ROSComm::send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int usound, int ir_left_front, int ir_left)
 {
   sensor_msgs::Range range;
-  range.header.stamp = ros::Time::now();
+  range.header.stamp = ros::Time(stamp);
 
   range.header.frame_id = tf::resolve(tf_prefix_, "ir_right_front");
   range.radiation_type = sensor_msgs::Range::INFRARED;
@@ -245,10 +299,10 @@ void ROSComm::send_sonar_front_usound_leftFront_left(int ir_right_front, int uso
   range_pub_.publish(range);
 }
 
-void ROSComm::send_sonar_back_rightBack_rightFront(int ir_back, int ir_right_back, int ir_right)
+void ROSComm::send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int ir_right_back, int ir_right)
 {
   sensor_msgs::Range range;
-  range.header.stamp = ros::Time::now();
+  range.header.stamp = ros::Time(stamp);
 
   range.header.frame_id = tf::resolve(tf_prefix_, "ir_back");
   range.radiation_type = sensor_msgs::Range::INFRARED;
@@ -275,19 +329,19 @@ void ROSComm::send_sonar_back_rightBack_rightFront(int ir_back, int ir_right_bac
   range_pub_.publish(range);
 }
 
-void ROSComm::send_pitch_roll(double pitch, double roll)
+void ROSComm::send_pitch_roll(double stamp, double pitch, double roll)
 {
   //TODO
 }
 
-void ROSComm::send_gyro(double theta, double sigma)
+void ROSComm::send_gyro(double stamp, double theta, double sigma)
 {
   sensor_msgs::Imu imu;
 
   // this is intentionally base_link (the location of the imu) and not base_footprint,
   // but because they are connected by a fixed link, it doesn't matter
   imu.header.frame_id = tf::resolve(tf_prefix_, "base_link");
-  imu.header.stamp = ros::Time::now();
+  imu.header.stamp = ros::Time(stamp);
 
   imu.angular_velocity_covariance[0] = -1; // no data avilable, see Imu.msg
   imu.linear_acceleration_covariance[0] = -1;
@@ -299,10 +353,10 @@ void ROSComm::send_gyro(double theta, double sigma)
   imu_pub_.publish(imu);
 }
 
-void ROSComm::send_rotunit(double rot)
+void ROSComm::send_rotunit(double stamp, double rot)
 {
   sensor_msgs::JointState joint_state;
-  joint_state.header.stamp = ros::Time::now();
+  joint_state.header.stamp = ros::Time(stamp);
   joint_state.name.resize(1);
   joint_state.position.resize(1);
   joint_state.name[0] = "laser_rot_joint";
@@ -311,43 +365,192 @@ void ROSComm::send_rotunit(double rot)
   joint_pub_.publish(joint_state);
 }
 
+// publishes CAN bus statistics snapshots on /diagnostics
+class Diagnostics
+{
+  public:
+    Diagnostics(ros::NodeHandle &n) :
+      diag_pub_(n.advertise<diagnostic_msgs::DiagnosticArray> ("diagnostics", 1)),
+      have_last_(false) { }
+
+    void publish(const CANStats &stats);
+
+  private:
+    static void add(diagnostic_msgs::DiagnosticStatus &status, const char *key, const char *format, double value);
+
+    ros::Publisher diag_pub_;
+    // the previous snapshot, rates are over the time since it
+    CANStats last_;
+    bool have_last_;
+};
+
+void Diagnostics::add(diagnostic_msgs::DiagnosticStatus &status, const char *key, const char *format, double value)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), format, value);
+  diagnostic_msgs::KeyValue kv;
+  kv.key = key;
+  kv.value = buf;
+  status.values.push_back(kv);
+}
+
+void Diagnostics::publish(const CANStats &stats)
+{
+  diagnostic_msgs::DiagnosticArray msg;
+  msg.header.stamp = ros::Time::now();
+
+  diagnostic_msgs::DiagnosticStatus bus;
+  bus.name = "kurt_base: CAN bus";
+  bus.hardware_id = "kurt";
+  bus.level = diagnostic_msgs::DiagnosticStatus::OK;
+  bus.message = "OK";
+  add(bus, "Unknown frames", "%.0f", stats.unknown_frames());
+  add(bus, "TX coalesced", "%.0f", stats.tx_coalesced);
+  add(bus, "TX dropped", "%.0f", stats.tx_dropped);
+  add(bus, "Control frames sent", "%.0f", stats.control_frames);
+  add(bus, "Control frames unchanged", "%.0f", stats.control_skipped);
+  add(bus, "Odometry frames bridged", "%.0f", stats.odometry_bridged);
+  add(bus, "Gyro disagreements", "%.0f", stats.gyro_disagreements);
+  if (stats.tx_dropped > 0)
+  {
+    bus.level = diagnostic_msgs::DiagnosticStatus::WARN;
+    bus.message = "Transmit queue overflow";
+  }
+  msg.status.push_back(bus);
+
+  const CANLatencyStats &latency = stats.control_latency;
+  diagnostic_msgs::DiagnosticStatus control;
+  control.name = "kurt_base: control latency";
+  control.hardware_id = "kurt";
+  control.level = diagnostic_msgs::DiagnosticStatus::OK;
+  control.message = "OK";
+  add(control, "Updates", "%.0f", latency.count);
+  if (latency.count > 0)
+  {
+    add(control, "Latency min [ms]", "%.2f", latency.min * 1000.0);
+    add(control, "Latency mean [ms]", "%.2f", latency.mean() * 1000.0);
+    add(control, "Latency p50 [ms]", "%.2f", latency.percentile(0.5) * 1000.0);
+    add(control, "Latency p99 [ms]", "%.2f", latency.percentile(0.99) * 1000.0);
+    add(control, "Latency max [ms]", "%.2f", latency.max * 1000.0);
+  }
+  msg.status.push_back(control);
+
+  for (size_t i = 0; i < stats.size(); i++)
+  {
+    const CANIdStats &id = stats.at(i);
+    char name[64];
+    snprintf(name, sizeof(name), "kurt_base: CAN ID 0x%03x", id.id);
+
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = name;
+    status.hardware_id = "kurt";
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.message = "OK";
+    // the first snapshot has no window yet
+    double rate = have_last_ ? stats.rate(i, last_) : id.rate();
+    add(status, "Frames", "%.0f", id.count);
+    add(status, "Rate [Hz]", "%.1f", rate);
+    if (id.count > 1)
+    {
+      add(status, "dt min [ms]", "%.2f", id.min_dt * 1000.0);
+      add(status, "dt mean [ms]", "%.2f", id.mean_dt() * 1000.0);
+      add(status, "dt max [ms]", "%.2f", id.max_dt * 1000.0);
+      add(status, "dt p99 [ms]", "%.2f", id.percentile_dt(0.99) * 1000.0);
+    }
+    add(status, "Decode errors", "%.0f", id.errors);
+    if (id.errors > 0)
+    {
+      status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+      status.message = "Decode errors";
+    }
+    if (have_last_ && rate == 0.0)
+    {
+      status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+      status.message = "No frames";
+    }
+    msg.status.push_back(status);
+  }
+
+  diag_pub_.publish(msg);
+  last_ = stats;
+  have_last_ = true;
+}
+
+struct Command
+{
+  enum Type
+  {
+    VELOCITY,
+    ROTUNIT
+  };
+
+  Type type;
+  double v_l_soll;
+  double v_r_soll;
+  double AntiWindup;
+  double rotunit_speed;
+  ros::Time stamp;
+};
+
+#define COMMAND_QUEUE_SIZE 64
+
+// in threaded mode the ROS callbacks only queue commands, they are executed
+// by the thread that owns the CAN socket (processCommands)
 class ROSCall
 {
   public:
-    ROSCall(Kurt &kurt, double axis_length) :
+    ROSCall(Kurt &kurt, double axis_length, bool threaded) :
       kurt_(kurt),
       axis_length_(axis_length),
       v_l_soll_(0.0),
       v_r_soll_(0.0),
       AntiWindup_(1.0),
-      last_cmd_vel_time_(0.0) { }
+      last_cmd_vel_time_(0.0),
+      command_fd_(threaded ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1) { }
+    ~ROSCall()
+    {
+      if (command_fd_ >= 0)
+        close(command_fd_);
+    }
     void velCallback(const geometry_msgs::Twist::ConstPtr& msg);
-    void pidCallback(const ros::TimerEvent& event);
+    void pidCallback(double stamp);
     void rotunitCallback(const geometry_msgs::Twist::ConstPtr& msg);
 
+    void processCommands();
+    int commandFd() const { return command_fd_; }
+
   private:
+    void submit(const Command &cmd);
+    void execute(const Command &cmd);
+
     Kurt &kurt_;
     double axis_length_;
     double v_l_soll_;
     double v_r_soll_;
     double AntiWindup_;
     ros::Time last_cmd_vel_time_;
+
+    int command_fd_;
+    SPSCRing<Command, COMMAND_QUEUE_SIZE> commands_;
 };
 
 void ROSCall::velCallback(const geometry_msgs::Twist::ConstPtr& msg)
 {
-  AntiWindup_ = 1.0;
-  last_cmd_vel_time_ = ros::Time::now();
-  v_l_soll_ = msg->linear.x - axis_length_ * msg->angular.z /*/ wheelRadius*/;
-  v_r_soll_ = msg->linear.x + axis_length_ * msg->angular.z/*/wheelRadius*/;
+  Command cmd;
+  cmd.type = Command::VELOCITY;
+  cmd.AntiWindup = 1.0;
+  cmd.stamp = ros::Time::now();
+  cmd.v_l_soll = msg->linear.x - axis_length_ * msg->angular.z /*/ wheelRadius*/;
+  cmd.v_r_soll = msg->linear.x + axis_length_ * msg->angular.z/*/wheelRadius*/;
 
   if (msg->linear.x == 0 && msg->angular.z == 0)
   {
-    AntiWindup_ = 0.0;
+    cmd.AntiWindup = 0.0;
   }
+  submit(cmd);
 }
 
-void ROSCall::pidCallback(const ros::TimerEvent& event)
+void ROSCall::pidCallback(double stamp)
 {
   double v_l_soll = 0.0;
   double v_r_soll = 0.0;
@@ -360,12 +563,330 @@ void ROSCall::pidCallback(const ros::TimerEvent& event)
     AntiWindup = AntiWindup_;
   }
 
-  kurt_.set_wheel_speed(v_l_soll, v_r_soll, AntiWindup);
+  kurt_.set_wheel_speed(v_l_soll, v_r_soll, AntiWindup, stamp);
 }
 
 void ROSCall::rotunitCallback(const geometry_msgs::Twist::ConstPtr& msg)
 {
-    kurt_.can_rotunit_send(msg->angular.z);
+  Command cmd;
+  cmd.type = Command::ROTUNIT;
+  cmd.rotunit_speed = msg->angular.z;
+  submit(cmd);
+}
+
+void ROSCall::submit(const Command &cmd)
+{
+  if (command_fd_ < 0)
+  {
+    execute(cmd);
+    return;
+  }
+
+  if (!commands_.push(cmd))
+  {
+    ROS_WARN("ROSCall: Command queue full, dropping command");
+    return;
+  }
+  uint64_t one = 1;
+  if (write(command_fd_, &one, sizeof(one)) != sizeof(one))
+    ROS_WARN("ROSCall: Error signaling command eventfd (%s)", strerror(errno));
+}
+
+void ROSCall::processCommands()
+{
+  uint64_t count;
+  if (read(command_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    ROS_WARN("ROSCall: Error reading command eventfd (%s)", strerror(errno));
+
+  Command cmd;
+  while (commands_.pop(cmd))
+    execute(cmd);
+}
+
+void ROSCall::execute(const Command &cmd)
+{
+  switch (cmd.type)
+  {
+    case Command::VELOCITY:
+      v_l_soll_ = cmd.v_l_soll;
+      v_r_soll_ = cmd.v_r_soll;
+      AntiWindup_ = cmd.AntiWindup;
+      last_cmd_vel_time_ = cmd.stamp;
+      break;
+    case Command::ROTUNIT:
+      kurt_.can_rotunit_send(cmd.rotunit_speed);
+      break;
+  }
+}
+
+// epoll reactor around the CAN socket and the 10 ms control tick. With a
+// callback queue it also services the ROS callbacks (single threaded mode),
+// otherwise it executes the queued commands of roscall and signals decoded
+// samples on notify_fd (receive thread mode).
+// [s] between two CAN statistics snapshots
+#define DIAGNOSTICS_PERIOD 1.0
+// [s] without CAN frames until the bus is reported silent
+#define SILENT_TIMEOUT 5.0
+
+typedef SPSCRing<CANStats, 2> StatsRing;
+
+class ControlLoop
+{
+  public:
+    // statistics snapshots are published directly through diagnostics or,
+    // if that is NULL, handed to the ROS thread through stats
+    ControlLoop(Kurt &kurt, ROSCall &roscall, EventCallbackQueue *queue, int notify_fd,
+        Diagnostics *diagnostics, StatsRing *stats, double control_rate, bool encoder_trigger) :
+      kurt_(kurt),
+      roscall_(roscall),
+      queue_(queue),
+      notify_fd_(notify_fd),
+      diagnostics_(diagnostics),
+      stats_(stats),
+      control_rate_(control_rate),
+      encoder_trigger_(encoder_trigger),
+      last_control_(0.0),
+      epfd_(-1),
+      pid_timer_(-1),
+      running_(true) { }
+    ~ControlLoop();
+
+    bool init();
+    void spin();
+    void stop() { running_ = false; }
+
+  private:
+    bool add(int fd);
+    void publish_stats();
+    void control(double now);
+
+    Kurt &kurt_;
+    ROSCall &roscall_;
+    EventCallbackQueue *queue_;
+    int notify_fd_;
+    Diagnostics *diagnostics_;
+    StatsRing *stats_;
+    CANStats snapshot_;
+    double control_rate_;
+    // run the controller for every new wheel speed sample, the timer only
+    // if they stop
+    bool encoder_trigger_;
+    double last_control_;
+    int epfd_;
+    int pid_timer_;
+    std::atomic<bool> running_;
+};
+
+static double monotonic_now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void ControlLoop::control(double now)
+{
+  roscall_.pidCallback(now);
+  last_control_ = now;
+}
+
+ControlLoop::~ControlLoop()
+{
+  if (epfd_ >= 0)
+    close(epfd_);
+  if (pid_timer_ >= 0)
+    close(pid_timer_);
+}
+
+bool ControlLoop::add(int fd)
+{
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    ROS_ERROR("Error adding fd to epoll set (%s)", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool ControlLoop::init()
+{
+  // control tick
+  long period_ns = lround(1e9 / control_rate_);
+  pid_timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  itimerspec period;
+  period.it_interval.tv_sec = period_ns / 1000000000;
+  period.it_interval.tv_nsec = period_ns % 1000000000;
+  period.it_value = period.it_interval;
+  if (pid_timer_ < 0 || timerfd_settime(pid_timer_, 0, &period, NULL) < 0)
+  {
+    ROS_ERROR("Error creating PID timer (%s)", strerror(errno));
+    return false;
+  }
+
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd_ < 0)
+  {
+    ROS_ERROR("Error creating epoll set (%s)", strerror(errno));
+    return false;
+  }
+
+  if (!add(kurt_.can_fd()) || !add(pid_timer_))
+    return false;
+  if (queue_ && !add(queue_->fd()))
+    return false;
+  if (roscall_.commandFd() >= 0 && !add(roscall_.commandFd()))
+    return false;
+  return true;
+}
+
+void ControlLoop::spin()
+{
+  // control ticks since the last CAN frame, to report a silent bus
+  unsigned int silent_ticks = 0;
+  // the bus was reported silent, the board probably restarts
+  bool silent = false;
+  unsigned int diag_ticks = 0;
+
+  while (running_ && ros::ok())
+  {
+    epoll_event events[4];
+    // the timeout bounds the latency of stop(), ros::ok() and the global queue
+    int nr = epoll_wait(epfd_, events, 4, 100);
+    if (nr < 0 && errno != EINTR)
+    {
+      ROS_ERROR("epoll_wait: %s", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < nr; i++)
+    {
+      int fd = events[i].data.fd;
+      if (fd == kurt_.can_fd())
+      {
+        if (silent)
+        {
+          // a restarted board counts from zero and its gyros settle anew
+          ROS_INFO("Receiving frames again, resetting odometry and controller");
+          kurt_.reset();
+          silent = false;
+        }
+        if (kurt_.can_read_fifo_batch(false) > 0)
+        {
+          if (encoder_trigger_ && kurt_.speed_sample())
+            control(monotonic_now());
+          silent_ticks = 0;
+          uint64_t one = 1;
+          if (notify_fd_ >= 0 && write(notify_fd_, &one, sizeof(one)) != sizeof(one))
+            ROS_WARN("Error signaling sample eventfd (%s)", strerror(errno));
+        }
+      }
+      else if (fd == pid_timer_)
+      {
+        uint64_t expirations;
+        if (read(pid_timer_, &expirations, sizeof(expirations)) != sizeof(expirations))
+          continue;
+        double now = monotonic_now();
+        if (!encoder_trigger_ || now - last_control_ > CONTROL_FALLBACK * ENCODER_PERIOD)
+          control(now);
+        silent_ticks += expirations;
+        if (silent_ticks >= SILENT_TIMEOUT * control_rate_)
+        {
+          ROS_ERROR("Receiving frame timed out (Kurt switched off?)");
+          silent_ticks = 0;
+          silent = true;
+        }
+        diag_ticks += expirations;
+        if (diag_ticks >= DIAGNOSTICS_PERIOD * control_rate_)
+        {
+          publish_stats();
+          diag_ticks = 0;
+        }
+      }
+      else if (fd == roscall_.commandFd())
+      {
+        roscall_.processCommands();
+      }
+      else if (queue_ && fd == queue_->fd())
+      {
+        queue_->callAvailable();
+      }
+    }
+
+    if (queue_)
+      ros::getGlobalCallbackQueue()->callAvailable();
+
+    // frames that did not fit into the device queue are retried on every
+    // wakeup, at the latest with the next control tick
+    if (kurt_.can_tx_pending())
+      kurt_.can_flush();
+  }
+}
+
+void ControlLoop::publish_stats()
+{
+  kurt_.snapshot_stats(&snapshot_);
+  if (diagnostics_)
+  {
+    diagnostics_->publish(snapshot_);
+  }
+  else if (stats_ && stats_->push(snapshot_))
+  {
+    // the previous snapshot is still pending otherwise, this one is skipped
+    uint64_t one = 1;
+    if (notify_fd_ >= 0 && write(notify_fd_, &one, sizeof(one)) != sizeof(one))
+      ROS_WARN("Error signaling sample eventfd (%s)", strerror(errno));
+  }
+}
+
+static void *receive_thread(void *arg)
+{
+  static_cast<ControlLoop *>(arg)->spin();
+  return NULL;
+}
+
+// starts the CAN receive thread with SCHED_FIFO priority, pinned to cpu
+// (if >= 0) and with all memory locked; falls back to normal scheduling if
+// the process may not use real-time priorities
+static bool start_receive_thread(pthread_t *thread, ControlLoop *loop, int priority, int cpu)
+{
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    ROS_WARN("Error locking memory (%s)", strerror(errno));
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+
+  sched_param param;
+  param.sched_priority = priority;
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  pthread_attr_setschedparam(&attr, &param);
+
+  if (cpu >= 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+
+  int rc = pthread_create(thread, &attr, receive_thread, loop);
+  if (rc == EPERM)
+  {
+    ROS_WARN("No permission for SCHED_FIFO, receive thread runs with normal priority");
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+    rc = pthread_create(thread, &attr, receive_thread, loop);
+  }
+  pthread_attr_destroy(&attr);
+
+  if (rc != 0)
+  {
+    ROS_ERROR("Error starting receive thread (%s)", strerror(rc));
+    return false;
+  }
+  return true;
 }
 
 int main(int argc, char** argv)
@@ -376,14 +897,14 @@ int main(int argc, char** argv)
 
   //Odometry parameter (defaults for kurt2 indoor)
   double wheel_perimeter;
-  nh_ns.param("wheel_perimeter", wheel_perimeter, 0.379);
+  nh_ns.param("wheel_perimeter", wheel_perimeter, KURT_WHEEL_PERIMETER);
   double axis_length;
-  nh_ns.param("axis_length", axis_length, 0.28);
+  nh_ns.param("axis_length", axis_length, KURT_AXIS_LENGTH);
 
   double turning_adaptation;
-  nh_ns.param("turning_adaptation", turning_adaptation, 0.69);
+  nh_ns.param("turning_adaptation", turning_adaptation, KURT_TURNING_ADAPTATION);
   int ticks_per_turn_of_wheel;
-  nh_ns.param("ticks_per_turn_of_wheel", ticks_per_turn_of_wheel, 21950);
+  nh_ns.param("ticks_per_turn_of_wheel", ticks_per_turn_of_wheel, KURT_TICKS_PER_TURN);
 
   double sigma_x, sigma_theta, cov_x_y, cov_x_theta, cov_y_theta;
   nh_ns.param("x_stddev", sigma_x, 0.002);
@@ -392,9 +913,47 @@ int main(int argc, char** argv)
   nh_ns.param("cov_xrotation", cov_x_theta, 0.0);
   nh_ns.param("cov_yrotation", cov_y_theta, 0.0);
 
+  //CAN parameter
+  CANConfig can_config;
+  nh_ns.param("can_interface", can_config.interface, std::string("can0"));
+  std::string can_backend;
+  nh_ns.param("can_backend", can_backend, std::string("raw"));
+  if (!can_backend_from_string(can_backend, &can_config.backend))
+  {
+    ROS_ERROR("Unknown can_backend %s (raw, packet, uring)", can_backend.c_str());
+    return 1;
+  }
+  nh_ns.param("record_file", can_config.record_file, std::string(""));
+
+  //Receive thread parameter
+  bool rt_thread;
+  nh_ns.param("rt_thread", rt_thread, false);
+  int rt_priority;
+  nh_ns.param("rt_priority", rt_priority, 80);
+  int rt_cpu;
+  nh_ns.param("rt_cpu", rt_cpu, -1);
+
+  //Control loop parameter
+  double control_rate;
+  nh_ns.param("control_rate", control_rate, 1.0 / CONTROL_PERIOD);
+  // an unchanged CAN_CONTROL is repeated on the control ticks, two of them
+  // must fall into the watchdog time of the C167
+  if (control_rate < 2.0 / CONTROL_WATCHDOG || control_rate > 1000.0)
+  {
+    ROS_ERROR("control_rate %g Hz out of range (%g - 1000 Hz)", control_rate, 2.0 / CONTROL_WATCHDOG);
+    return 1;
+  }
+  //control update for every encoder frame, control_rate is the fallback
+  bool encoder_trigger;
+  nh_ns.param("encoder_trigger", encoder_trigger, false);
+
   ROSComm roscomm(n, sigma_x, sigma_theta, cov_x_y, cov_x_theta, cov_y_theta, ticks_per_turn_of_wheel);
+  // in receive thread mode Kurt decodes into a queue that is published here
+  QueueComm queuecomm;
+  Comm &comm = rt_thread ? static_cast<Comm &>(queuecomm) : static_cast<Comm &>(roscomm);
 
-  Kurt kurt(roscomm, wheel_perimeter, axis_length, turning_adaptation, ticks_per_turn_of_wheel);
+  Kurt kurt(comm, wheel_perimeter, axis_length, turning_adaptation, ticks_per_turn_of_wheel, can_config);
+  kurt.setControlRate(control_rate);
 
   //PID parameter (disables micro controller)
   std::string speedPwmLeerlaufTable;
@@ -407,8 +966,32 @@ int main(int argc, char** argv)
     nh_ns.param("kp", kp, 0.4);
     if (!kurt.setPWMData(speedPwmLeerlaufTable, feedforward_turn, ki, kp))
       return 1;
+    //learn the speed table on the current ground, saved on shutdown
+    std::string speedtable_adapt;
+    if (nh_ns.getParam("speedtable_adapt", speedtable_adapt) &&
+        !kurt.setFeedForwardAdaptation(speedtable_adapt))
+      return 1;
   }
 
+  //odometry from the accumulated encoder counts, robust against lost frames
+  bool use_getspeed;
+  nh_ns.param("use_getspeed", use_getspeed, false);
+  kurt.setGetSpeedOdometry(use_getspeed);
+
+  //heading from both gyros
+  bool use_gyro_mc2;
+  nh_ns.param("use_gyro_mc2", use_gyro_mc2, false);
+  kurt.setGyroFusion(use_gyro_mc2);
+
+  //micro controller mode: kernel timed CAN_CONTROL frames
+  bool use_bcm;
+  nh_ns.param("use_bcm", use_bcm, false);
+  kurt.setBCM(use_bcm);
+  //micro controller mode: repetition of an unchanged CAN_CONTROL
+  double control_keepalive;
+  nh_ns.param("control_keepalive", control_keepalive, CONTROL_KEEPALIVE);
+  kurt.setControlKeepalive(control_keepalive);
+
   bool use_rotunit;
   nh_ns.param("use_rotunit", use_rotunit, false);
   if (use_rotunit) {
@@ -423,19 +1006,80 @@ int main(int argc, char** argv)
   tf_prefix = tf::getPrefixParam(nh_ns);
   roscomm.setTFPrefix(tf_prefix);
 
-  ROSCall roscall(kurt, axis_length);
+  ROSCall roscall(kurt, axis_length, rt_thread);
+
+  EventCallbackQueue queue;
+  n.setCallbackQueue(&queue);
 
-  ros::Timer pid_timer = n.createTimer(ros::Duration(0.01), &ROSCall::pidCallback, &roscall);
   ros::Subscriber cmd_vel_sub = n.subscribe("cmd_vel", 10, &ROSCall::velCallback, &roscall);
   ros::Subscriber rot_vel_sub;
   if (use_rotunit)
     rot_vel_sub = n.subscribe("rot_vel", 10, &ROSCall::rotunitCallback, &roscall);
 
+  Diagnostics diagnostics(n);
+
+  if (!rt_thread)
+  {
+    ControlLoop loop(kurt, roscall, &queue, -1, &diagnostics, NULL, control_rate, encoder_trigger);
+    if (!loop.init())
+      return 1;
+    loop.spin();
+    return 0;
+  }
+
+  int sample_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  StatsRing stats;
+  ControlLoop loop(kurt, roscall, NULL, sample_fd, NULL, &stats, control_rate, encoder_trigger);
+  pthread_t thread;
+  if (!loop.init() || !start_receive_thread(&thread, &loop, rt_priority, rt_cpu))
+    return 1;
+
+  // this thread only handles ROS callbacks and publishes decoded samples
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  int fds[] = { queue.fd(), sample_fd };
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+  {
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[i];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+  }
+
+  unsigned long dropped = 0;
+  CANStats snapshot;
   while (ros::ok())
   {
-    kurt.can_read_fifo();
-    ros::spinOnce();
+    epoll_event events[2];
+    int nr = epoll_wait(epfd, events, 2, 100);
+    for (int i = 0; i < nr; i++)
+    {
+      if (events[i].data.fd == sample_fd)
+      {
+        uint64_t count;
+        if (read(sample_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          ROS_WARN("Error reading sample eventfd (%s)", strerror(errno));
+        queuecomm.forward(roscomm);
+        if (stats.pop(snapshot))
+          diagnostics.publish(snapshot);
+      }
+      else
+      {
+        queue.callAvailable();
+      }
+    }
+    ros::getGlobalCallbackQueue()->callAvailable();
+
+    if (queuecomm.dropped() != dropped)
+    {
+      ROS_WARN("Publishing too slow, dropped %lu samples", queuecomm.dropped() - dropped);
+      dropped = queuecomm.dropped();
+    }
   }
 
+  loop.stop();
+  pthread_join(thread, NULL);
+  close(epfd);
+  close(sample_fd);
+
   return 0;
 }
@@ -1,46 +1,68 @@
-#include <stdio.h>
-#include <sys/time.h>
+#include <errno.h>
 #include <time.h>
-#include <unistd.h>
 
 #include "mytime.h"
 
-long double    mseconds;
+int64_t mytime_now(void)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
+// sleeps until the absolute monotonic time deadline, also across signals
+static void sleep_until(int64_t deadline)
+{
+  timespec ts;
+  ts.tv_sec = deadline / 1000000000;
+  ts.tv_nsec = deadline % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) ;
+}
 
-unsigned long GetCurrentTimeInMilliSec(void)
+void mytime_start(MyTimer *timer)
 {
-  struct timeval tv;
-  unsigned long milliseconds;
-  gettimeofday(&tv, NULL);
-  milliseconds = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-  return milliseconds;
+  timer->start = mytime_now();
 }
 
-// Zeitmessung NR_TIMER -1 special since programm start
-// timer 0 is for local use
-long double Get_mtime_diff(int timer_number)
+long double mytime_elapsed_ms(const MyTimer *timer)
 {
-  static double   prev_clock[NR_TIMER];
-  static int      first_time = 1;
-  double          new_clock, clock_diff;
-  int             i;
+  return (mytime_now() - timer->start) / 1e6L;
+}
 
-  if (first_time) {
-    new_clock = GetCurrentTimeInMilliSec();
-    for (i = 0; i < NR_TIMER; i++) {
-      prev_clock[i] = new_clock;
-    }
-    clock_diff = new_clock;
-    first_time = 0;
-  }
-  else {
-    new_clock = GetCurrentTimeInMilliSec();
-    clock_diff = new_clock - prev_clock[timer_number];
-    if (timer_number != (NR_TIMER - 1)) prev_clock[timer_number] = new_clock;
+void mytime_periodic_start(MyPeriodic *periodic, int64_t period)
+{
+  periodic->period = period;
+  periodic->next = mytime_now() + period;
+  periodic->cycles = 0;
+  periodic->overruns = 0;
+}
+
+// moves on to the first deadline after now
+static void periodic_advance(MyPeriodic *periodic, int64_t now)
+{
+  periodic->next += periodic->period;
+  periodic->cycles++;
+  if (now >= periodic->next)
+  {
+    int64_t missed = (now - periodic->next) / periodic->period + 1;
+    periodic->next += missed * periodic->period;
+    periodic->overruns += missed;
   }
+}
 
-  return(clock_diff);
+void mytime_periodic_wait(MyPeriodic *periodic)
+{
+  sleep_until(periodic->next);
+  periodic_advance(periodic, mytime_now());
+}
+
+bool mytime_periodic_due(MyPeriodic *periodic)
+{
+  int64_t now = mytime_now();
+  if (now < periodic->next)
+    return false;
+  periodic_advance(periodic, now);
+  return true;
 }
 
 /*-------------------------------------------------------------------------*
@@ -55,12 +77,5 @@ long double Get_mtime_diff(int timer_number)
  *-------------------------------------------------------------------------*/
 void mydelay (unsigned long msec)
 {
-  unsigned long start_clock, cur_clock;
-
-  start_clock = GetCurrentTimeInMilliSec();
-
-  do  {
-    cur_clock  = GetCurrentTimeInMilliSec();
-  } while ((cur_clock - start_clock) < msec);
-
+  sleep_until(mytime_now() + MYTIME_MS(msec));
 }
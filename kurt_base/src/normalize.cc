@@ -0,0 +1,75 @@
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "normalize.h"
+
+static int ir_curve(int ir)
+{
+  if (ir < IR_MIN * 1000 || ir > IR_MAX * 1000) // convert m --> mm
+  {
+    return -1;
+  }
+  return (int)(pow(30000.0 / ((double)ir - 10.0), 1.0 / 1.4) - 10.0);
+}
+
+static int sonar_curve(int s)
+{
+  if (s < SONAR_MIN * 1000 || s > SONAR_MAX * 1000) // convert m --> mm
+  {
+    return -1;
+  }
+  return (int)((double)s * 0.110652 + 11.9231);
+}
+
+SensorTables::SensorTables()
+{
+  for (int i = IR_RAW_MIN; i <= IR_RAW_MAX; i++)
+    table_[i - IR_RAW_MIN] = ir_curve(i);
+  for (int i = SONAR_RAW_MIN; i <= SONAR_RAW_MAX; i++)
+    table_[IR_TABLE_SIZE + i - SONAR_RAW_MIN] = sonar_curve(i);
+}
+
+// per channel: first raw value of the table, its size and its offset
+static const int channel_min[2] = { IR_RAW_MIN, SONAR_RAW_MIN };
+static const int channel_size[2] = { IR_TABLE_SIZE, SONAR_TABLE_SIZE };
+static const int channel_base[2] = { 0, IR_TABLE_SIZE };
+
+void SensorTables::normalize_frame(const int64_t *raw, const SensorChannel *channels, int nr, int *out) const
+{
+#ifdef __SSE2__
+  // unused lanes get a raw value outside every range
+  int r[4] = { -1, -1, -1, -1 }, min[4] = { 0, 0, 0, 0 }, size[4] = { 0, 0, 0, 0 }, base[4] = { 0, 0, 0, 0 };
+  for (int i = 0; i < nr && i < 4; i++)
+  {
+    // raw values are 16 bit fields, anything larger is out of range anyway
+    r[i] = raw[i] < 0 || raw[i] > 0xFFFF ? -1 : (int)raw[i];
+    min[i] = channel_min[channels[i]];
+    size[i] = channel_size[channels[i]];
+    base[i] = channel_base[channels[i]];
+  }
+
+  __m128i index = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)r), _mm_loadu_si128((const __m128i *)min));
+  // 0 <= index < size
+  __m128i valid = _mm_and_si128(
+      _mm_cmpgt_epi32(index, _mm_set1_epi32(-1)),
+      _mm_cmplt_epi32(index, _mm_loadu_si128((const __m128i *)size)));
+  // invalid lanes read entry 0 and are masked to -1 below
+  index = _mm_and_si128(_mm_add_epi32(index, _mm_loadu_si128((const __m128i *)base)), valid);
+
+  int idx[4];
+  _mm_storeu_si128((__m128i *)idx, index);
+  __m128i value = _mm_setr_epi32(table_[idx[0]], table_[idx[1]], table_[idx[2]], table_[idx[3]]);
+  value = _mm_or_si128(_mm_and_si128(valid, value), _mm_andnot_si128(valid, _mm_set1_epi32(-1)));
+
+  int result[4];
+  _mm_storeu_si128((__m128i *)result, value);
+  for (int i = 0; i < nr && i < 4; i++)
+    out[i] = result[i];
+#else
+  for (int i = 0; i < nr; i++)
+    out[i] = channels[i] == SENSOR_SONAR ? sonar(raw[i]) : ir(raw[i]);
+#endif
+}
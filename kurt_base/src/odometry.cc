@@ -0,0 +1,58 @@
+#include <cmath>
+
+#include "odometry.h"
+
+Odometry::Odometry(double wheel_perimeter, double axis_length, double turning_adaptation,
+    int ticks_per_turn_of_wheel) :
+  meter_per_tick_(wheel_perimeter / ticks_per_turn_of_wheel),
+  rad_per_tick_(wheel_perimeter / ticks_per_turn_of_wheel / axis_length * turning_adaptation)
+{
+  reset();
+}
+
+void Odometry::reset()
+{
+  total_left_ = total_right_ = 0;
+  x_ = z_ = 0.0;
+  x_error_ = z_error_ = 0.0;
+}
+
+double Odometry::theta() const
+{
+  return remainder((double)(total_left_ - total_right_) * rad_per_tick_, 2.0 * M_PI);
+}
+
+// compensated sum += value
+static void kahan_add(double *sum, double *error, double value)
+{
+  double y = value - *error;
+  double t = *sum + y;
+  *error = (t - *sum) - y;
+  *sum = t;
+}
+
+void Odometry::add(int64_t ticks_left, int64_t ticks_right)
+{
+  update(total_left_ + ticks_left, total_right_ + ticks_right);
+}
+
+void Odometry::update(int64_t total_left, int64_t total_right)
+{
+  int64_t ticks_left = total_left - total_left_;
+  int64_t ticks_right = total_right - total_right_;
+
+  // both wheels on concentric circles: the robot moves on an arc of length
+  // d turning by dtheta; its chord has the length d * sin(dtheta / 2) /
+  // (dtheta / 2) and points along the heading in the middle of the arc
+  double theta = this->theta();
+  double dtheta = (double)(ticks_left - ticks_right) * rad_per_tick_;
+  double d = 0.5 * (double)(ticks_left + ticks_right) * meter_per_tick_;
+  double half = 0.5 * dtheta;
+  double chord = fabs(half) < 1e-4 ? d * (1.0 - half * half / 6.0) : d * sin(half) / half;
+
+  kahan_add(&x_, &x_error_, chord * sin(theta + half));
+  kahan_add(&z_, &z_error_, chord * cos(theta + half));
+
+  total_left_ = total_left;
+  total_right_ = total_right;
+}
@@ -0,0 +1,88 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "kurt.h"
+#include "comm.h"
+
+// counts the decoded messages and writes the odometry trace to a file
+class ReplayComm : public Comm
+{
+  public:
+    ReplayComm(FILE *odometry) : odometry_(odometry), nr_odometry_(0), nr_sonar_(0),
+      nr_gyro_(0), nr_rotunit_(0), z_(0.0), x_(0.0), theta_(0.0) { }
+
+    void send_odometry(double stamp, double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right)
+    {
+      nr_odometry_++;
+      z_ = z;
+      x_ = x;
+      theta_ = theta;
+      if (odometry_ != NULL)
+        fprintf(odometry_, "%.9f %f %f %f %f %f %d %d\n", stamp, z, x, theta, v_encoder, v_encoder_angular, wheel_a, wheel_b);
+    }
+
+    void send_sonar_leftBack(double stamp, int ir_left_back) { nr_sonar_++; }
+    void send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int usound, int ir_left_front, int ir_left) { nr_sonar_++; }
+    void send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int ir_right_back, int ir_right) { nr_sonar_++; }
+    void send_pitch_roll(double stamp, double pitch, double roll) { }
+    void send_gyro(double stamp, double theta, double sigma) { nr_gyro_++; }
+    void send_rotunit(double stamp, double rot) { nr_rotunit_++; }
+
+    void print()
+    {
+      printf("odometry: %lu gyro: %lu sonar: %lu rotunit: %lu\n", nr_odometry_, nr_gyro_, nr_sonar_, nr_rotunit_);
+      printf("final pose: z: %f x: %f theta: %f\n", z_, x_, theta_);
+    }
+
+  private:
+    FILE *odometry_;
+    unsigned long nr_odometry_, nr_sonar_, nr_gyro_, nr_rotunit_;
+    double z_, x_, theta_;
+};
+
+void usage(char *pgrname)
+{
+  printf("%s: <logfile> [speed] [odometry-output]\n", pgrname);
+  printf("speed: 1 real time, N N times faster, 0 as fast as possible (default)\n");
+}
+
+int main(int argc, char **argv)
+{
+  FILE *fpr = NULL;
+
+  if (argc < 2) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  CANConfig can_config;
+  can_config.backend = CAN_BACKEND_REPLAY;
+  can_config.replay_file = argv[1];
+  can_config.replay_speed = argc > 2 ? atof(argv[2]) : 0.0;
+
+  if (argc > 3) {
+    fpr = fopen(argv[3], "w");
+    if (fpr == NULL) {
+      printf("Error opening %s\n", argv[3]);
+      return 1;
+    }
+  }
+
+  //Odometry parameter (defaults for kurt2 indoor)
+  double wheel_perimeter = KURT_WHEEL_PERIMETER;
+  double axis_length = KURT_AXIS_LENGTH;
+
+  double turning_adaptation = KURT_TURNING_ADAPTATION;
+  int ticks_per_turn_of_wheel = KURT_TICKS_PER_TURN;
+
+  ReplayComm replaycomm(fpr);
+  {
+    Kurt kurt(replaycomm, wheel_perimeter, axis_length, turning_adaptation, ticks_per_turn_of_wheel, can_config);
+    while (kurt.can_read_fifo_batch() >= 0) ;
+  }
+
+  replaycomm.print();
+  if (fpr != NULL)
+    fclose(fpr);
+  return 0;
+}
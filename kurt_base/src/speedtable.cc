@@ -1,30 +1,241 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
+
+#include <unistd.h>
 
 #include "kurt.h"
 #include "stdoutcomm.h"
 #include "mytime.h"
 
+// fast mode: pwm steps between two samples, adapted to the curvature of
+// the speed curve like the step size of an ode solver
+#define FAST_STEP_MIN   2
+#define FAST_STEP_MAX   64
+// allowed deviation of a sample from the line through the two before:
+// FAST_TOLERANCE [m/s] or FAST_TOLERANCE_REL of the speed, if larger
+#define FAST_TOLERANCE  0.005
+#define FAST_TOLERANCE_REL 0.02
+// a sample is settled when the mean speed of two consecutive windows of
+// FAST_WINDOW encoder frames differs by less than FAST_SETTLE [m/s]
+#define FAST_WINDOW     10
+#define FAST_SETTLE     0.001
+#define FAST_SETTLE_MAX 200 // [encoder frames] give up waiting after 2 s
+
+struct Sample
+{
+  int pwm;
+  long double t;
+  double v_left, v_right;
+};
+
 void usage(char *pgrname)
 {
-  printf("%s: <configfile> <start-pwm-value>\n",pgrname);
+  printf("%s: [-f] <configfile> <start-pwm-value> [can-interface]\n",pgrname);
+  printf("  -f  fast mode: adaptive pwm steps, settled samples and a fitted table\n");
+}
+
+// drives both wheels with pwm until the encoder speed is stable and returns
+// the mean speed of the last window
+static void measure(Kurt &kurt, STDoutComm &stdoutcomm, const MyTimer *start, int pwm, Sample *sample)
+{
+  double sum_l = 0.0, sum_r = 0.0;
+  double prev_l = -1.0, prev_r = -1.0;
+  int frames;
+
+  for (frames = 1; frames <= FAST_SETTLE_MAX; frames++) {
+    // alle 100 ms senden sonst ausfall, hier mit jedem encoder frame
+    kurt.can_motor(1024 - pwm, 0, 0, 1024 - pwm, 0, 0);
+    while (kurt.can_read_fifo() != CAN_ENCODER) ;
+    sum_l += stdoutcomm.v1_left();
+    sum_r += stdoutcomm.v1_right();
+
+    if (frames % FAST_WINDOW == 0) {
+      double v_l = sum_l / FAST_WINDOW;
+      double v_r = sum_r / FAST_WINDOW;
+      sum_l = sum_r = 0.0;
+      sample->v_left = v_l;
+      sample->v_right = v_r;
+      if (fabs(v_l - prev_l) < FAST_SETTLE && fabs(v_r - prev_r) < FAST_SETTLE)
+        break;
+      prev_l = v_l;
+      prev_r = v_r;
+    }
+  }
+  if (frames > FAST_SETTLE_MAX)
+    printf("pwm %d not settled\n", pwm);
+
+  sample->pwm = pwm;
+  sample->t = mytime_elapsed_ms(start);
+  printf("t1: %Lf, vl: %lf, vr: %lf, pwm: %d, frames: %d\n",
+      sample->t, sample->v_left, sample->v_right, pwm, frames);
+}
+
+// sweeps from startpwm to 1024 and returns all samples sorted by pwm. The
+// step grows while the samples lie on the line through the two before and a
+// sample that deviates more than the tolerance is repeated with half the
+// step, so the samples are dense where the curve bends.
+static std::vector<Sample> sample_fast(Kurt &kurt, STDoutComm &stdoutcomm, const MyTimer *start, int startpwm)
+{
+  std::vector<Sample> samples;
+  Sample sample, prev, last;
+  int step = FAST_STEP_MIN;
+
+  measure(kurt, stdoutcomm, start, startpwm, &prev);
+  samples.push_back(prev);
+  measure(kurt, stdoutcomm, start, std::min(1024, startpwm + step), &last);
+  samples.push_back(last);
+
+  while (last.pwm < 1024) {
+    int pwm = std::min(1024, last.pwm + step);
+    measure(kurt, stdoutcomm, start, pwm, &sample);
+    samples.push_back(sample);
+
+    double a = (double)(pwm - last.pwm) / (last.pwm - prev.pwm);
+    double err_l = fabs(sample.v_left - (last.v_left + (last.v_left - prev.v_left) * a));
+    double err_r = fabs(sample.v_right - (last.v_right + (last.v_right - prev.v_right) * a));
+    double err = std::max(err_l, err_r);
+
+    double tolerance = std::max(FAST_TOLERANCE, FAST_TOLERANCE_REL * std::max(last.v_left, last.v_right));
+    if (err > tolerance && step > FAST_STEP_MIN) {
+      // repeat the step with half the size, the sample is kept for the fit
+      step = std::max(FAST_STEP_MIN, step / 2);
+      continue;
+    }
+    if (err < 0.25 * tolerance)
+      step = std::min(FAST_STEP_MAX, step * 2);
+    else if (err > tolerance)
+      step = FAST_STEP_MIN;
+    prev = last;
+    last = sample;
+  }
+
+  // a repeated step can measure the same pwm twice, keep them in the
+  // order they were measured
+  std::stable_sort(samples.begin(), samples.end(),
+      [](const Sample &a, const Sample &b) { return a.pwm < b.pwm; });
+  return samples;
+}
+
+// monotone cubic (Fritsch-Carlson) interpolation of the speeds v at the
+// sample pwm values p, evaluated for every pwm in 0 .. 1024
+static void fit_monotone(const std::vector<int> &p, std::vector<double> v, double *table)
+{
+  size_t n = p.size();
+
+  // speed must not decrease with pwm, as in the slow mode
+  for (size_t k = 1; k < n; k++)
+    v[k] = std::max(v[k], v[k - 1]);
+
+  std::vector<double> d(n - 1), m(n);
+  for (size_t k = 0; k + 1 < n; k++)
+    d[k] = (v[k + 1] - v[k]) / (p[k + 1] - p[k]);
+  m[0] = d[0];
+  m[n - 1] = d[n - 2];
+  for (size_t k = 1; k + 1 < n; k++)
+    m[k] = (d[k - 1] == 0.0 || d[k] == 0.0) ? 0.0 : 0.5 * (d[k - 1] + d[k]);
+  for (size_t k = 0; k + 1 < n; k++) {
+    if (d[k] == 0.0) {
+      m[k] = m[k + 1] = 0.0;
+      continue;
+    }
+    double a = m[k] / d[k], b = m[k + 1] / d[k];
+    double s = a * a + b * b;
+    if (s > 9.0) {
+      double t = 3.0 / sqrt(s);
+      m[k] = t * a * d[k];
+      m[k + 1] = t * b * d[k];
+    }
+  }
+
+  size_t k = 0;
+  for (int pwm = 0; pwm <= 1024; pwm++) {
+    if (pwm <= p[0]) {
+      table[pwm] = pwm < p[0] ? 0.0 : v[0];
+      continue;
+    }
+    while (k + 2 < n && pwm > p[k + 1])
+      k++;
+    if (pwm >= p[n - 1]) {
+      table[pwm] = v[n - 1];
+      continue;
+    }
+    double h = p[k + 1] - p[k];
+    double t = (pwm - p[k]) / h;
+    double h00 = (1 + 2 * t) * (1 - t) * (1 - t), h10 = t * (1 - t) * (1 - t);
+    double h01 = t * t * (3 - 2 * t), h11 = t * t * (t - 1);
+    table[pwm] = h00 * v[k] + h10 * h * m[k] + h01 * v[k + 1] + h11 * h * m[k + 1];
+  }
+}
+
+// writes the fitted table in the format of the slow mode for pwm 0 .. 1024;
+// the time column is the one of the sample at or below each pwm
+static void write_fast(FILE *fpr, const std::vector<Sample> &samples)
+{
+  std::vector<int> p;
+  std::vector<double> v_l, v_r;
+  for (size_t k = 0; k < samples.size(); k++) {
+    // a pwm measured twice keeps the later sample
+    if (!p.empty() && p.back() == samples[k].pwm) {
+      v_l.back() = samples[k].v_left;
+      v_r.back() = samples[k].v_right;
+      continue;
+    }
+    p.push_back(samples[k].pwm);
+    v_l.push_back(samples[k].v_left);
+    v_r.push_back(samples[k].v_right);
+  }
+
+  double table_l[1025], table_r[1025];
+  fit_monotone(p, v_l, table_l);
+  fit_monotone(p, v_r, table_r);
+
+  size_t k = 0;
+  for (int pwm = 0; pwm <= 1024; pwm++) {
+    while (k + 1 < samples.size() && samples[k + 1].pwm <= pwm)
+      k++;
+    fprintf(fpr, "%Lf %lf %lf %lf %d\n",
+        samples[k].t,
+        0.5 * (table_l[pwm] + table_r[pwm]),
+        table_l[pwm],
+        table_r[pwm],
+        pwm);
+  }
 }
 
 int main(int argc, char **argv)
 {
   FILE *fpr = NULL;
-  long double Time_Diff1 = 1000.0; // time
-  long double Time_Diff2 = 0.0; // time
   int i,j, k;
   double v1=0.0, prev_v1=0.0; // position update
   double v1_left = 0.0, v1_right=0.0;  // current speed
   double prev_v1_left=0.0, prev_v1_right=0.0;  // previous  speed
   int finish = 0;
   int startpwm = 1;
+  bool fast = false;
+  int opt;
 
-  if (argc == 3) {
-    startpwm = atoi(argv[2]);
+  while ((opt = getopt(argc, argv, "fh")) != -1) {
+    if (opt == 'f')
+      fast = true;
+    else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+  // positional arguments as without options
+  argv[optind - 1] = argv[0];
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  CANConfig can_config;
+  if (argc == 3 || argc == 4) {
+    startpwm = std::max(1, std::min(1023, atoi(argv[2])));
+    if (argc == 4)
+      can_config.interface = argv[3];
   }
   else {
     usage(argv[0]);
@@ -32,32 +243,58 @@ int main(int argc, char **argv)
   }
 
   fpr = fopen(argv[1], "w");
+  if (fpr == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
 
-  // fill with zeros until startpwm
-  for (i = 1; i < startpwm;i++) {
-    fprintf(fpr,"%Lf 0.0 0.0 0.0 %d\n",Get_mtime_diff(9), i);
+  // run time in ms for the first column
+  MyTimer start;
+  mytime_start(&start);
+
+  // fill with zeros until startpwm (the fast mode writes the whole table)
+  for (i = 1; i < startpwm && !fast;i++) {
+    fprintf(fpr,"%Lf 0.0 0.0 0.0 %d\n",mytime_elapsed_ms(&start), i);
   }
 
   //Odometry parameter (defaults for kurt2 indoor)
-  double wheel_perimeter = 0.379;
-  double axis_length = 0.28;
+  double wheel_perimeter = KURT_WHEEL_PERIMETER;
+  double axis_length = KURT_AXIS_LENGTH;
 
-  double turning_adaptation = 0.69;
-  int ticks_per_turn_of_wheel = 21950;
+  double turning_adaptation = KURT_TURNING_ADAPTATION;
+  int ticks_per_turn_of_wheel = KURT_TICKS_PER_TURN;
 
   STDoutComm stdoutcomm;
-  Kurt kurt(stdoutcomm, wheel_perimeter, axis_length, turning_adaptation, ticks_per_turn_of_wheel);
+  Kurt kurt(stdoutcomm, wheel_perimeter, axis_length, turning_adaptation, ticks_per_turn_of_wheel, can_config);
+
+  if (fast) {
+    std::vector<Sample> samples = sample_fast(kurt, stdoutcomm, &start, startpwm);
+    printf("%zu samples\n", samples.size());
+    write_fast(fpr, samples);
+    fclose(fpr);
+
+    // stoppen ueber 50 * 20 ms, die Raeder laufen frei
+    MyPeriodic ramp;
+    mytime_periodic_start(&ramp, MYTIME_MS(20));
+    for (k = 0; k < 50; k++) {
+      int pwm = 1024 - 1024 * (50 - k) / 50;
+      kurt.can_motor(pwm, 0, 0, pwm, 0, 0);
+      mytime_periodic_wait(&ramp);
+    }
+    printf("Closing the can connection\n");
+    return 0;
+  }
 
   i = j = startpwm;
-  Get_mtime_diff(3);
-  Get_mtime_diff(2);
+  // jede sekunde neuer wert, alle 100 ms senden sonst ausfall
+  MyPeriodic sample, send;
+  mytime_periodic_start(&sample, MYTIME_MS(1000));
+  mytime_periodic_start(&send, MYTIME_MS(100));
+  bool send_now = true;
   int pwm_left, pwm_right;
   do {
-    Time_Diff1 -= Get_mtime_diff(3);
-    Time_Diff2 -= Get_mtime_diff(2);
-    //printf("Hallo %Lf %Lf\n",Time_Diff1,Time_Diff2);
-    if (Time_Diff2 <= 0.0) {
-      Time_Diff2 = 100; // alle 100 ms senden sonst ausfall
+    if (send_now || mytime_periodic_due(&send)) {
+      send_now = false;
       // speed auf die motoren
       pwm_left = 1024-i;
       pwm_right = 1024-j;
@@ -72,7 +309,7 @@ int main(int argc, char **argv)
     v1_right = stdoutcomm.v1_right();
 
     //  get_current_old(0);
-    if (Time_Diff1 <= 0.0) { // jede sekunde neuer wert
+    if (mytime_periodic_due(&sample)) { // jede sekunde neuer wert
 
       if ((v1_left < prev_v1_left)   || (prev_v1_left > 0.0  && 2.0 * prev_v1_left < v1_left)) {
         v1_left = prev_v1_left;
@@ -89,20 +326,19 @@ int main(int argc, char **argv)
 
       //  get_multimeter(1);
       //  get_current_old(1);
-      printf("t1: %Lf, %Lf, %Lf, v: %lf, vl: %lf, vr: %lf, pwm: %d\n",
-          Get_mtime_diff(9), Time_Diff1, Time_Diff2,
+      printf("t1: %Lf, overruns: %lu, %lu, v: %lf, vl: %lf, vr: %lf, pwm: %d\n",
+          mytime_elapsed_ms(&start), sample.overruns, send.overruns,
           v1,
           v1_left,
           v1_right,
           i);
       fprintf(fpr,"%Lf %lf %lf %lf %d\n",
-          Get_mtime_diff(9),
+          mytime_elapsed_ms(&start),
           v1,
           v1_left,
           v1_right,
           i);
-      Time_Diff1 += 1000.0;
-      Time_Diff2 = 0.0;
+      send_now = true;
       i++; j++;
       prev_v1_left = v1_left;
       prev_v1_right = v1_right;
@@ -114,6 +350,7 @@ int main(int argc, char **argv)
   j--;
 
   // langsames stoppen ueber 1024 * 20 ms
+  mytime_periodic_start(&send, MYTIME_MS(20));
   for (k = 0; k < i; k+=1 ) {
     pwm_left = 1024-i+k;
     pwm_right = 1024-j+k;
@@ -133,7 +370,7 @@ int main(int argc, char **argv)
     );
     }
     */
-    mydelay(20);
+    mytime_periodic_wait(&send);
   }
   fclose(fpr);
   printf("Closing the can connection\n");
@@ -0,0 +1,246 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+#include "board_log.h"
+#include "canframes.h"
+#include "canlog.h"
+#include "comm.h"
+#include "kurt.h"
+#include "vcan.h"
+
+// Decoding cost per frame over a replayed board session:
+//
+//   switch  a copy of the switch in can_dispatch and the shift expressions
+//           of the decoders before the decoder table
+//   table   one indexed call through a table of CANLayout decoders, as
+//           Kurt::can_dispatch does now
+//   kurt    the whole Kurt::can_read_fifo_batch() on the replay backend,
+//           handlers included, for comparison
+//
+// switch and table only extract the fields and add them up, both sums must
+// be equal.
+
+class NullComm : public Comm
+{
+  public:
+    void send_odometry(double stamp, double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right) { }
+    void send_sonar_leftBack(double stamp, int ir_left_back) { }
+    void send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int usound, int ir_left_front, int ir_left) { }
+    void send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int ir_right_back, int ir_right) { }
+    void send_pitch_roll(double stamp, double pitch, double roll) { }
+    void send_gyro(double stamp, double theta, double sigma) { }
+    void send_rotunit(double stamp, double rot) { }
+};
+
+// the decoders of the switch, copied with their shift expressions (the
+// gyro fields go through uint32_t, data[0] << 24 overflows int)
+static int64_t switch_decode(const can_frame &frame)
+{
+  int dlc;
+  switch (frame.can_id) {
+    case CAN_ADC00_03:
+    case CAN_TILT_COMP:
+      dlc = 6;
+      break;
+    case CAN_ADC04_07:
+    case CAN_GYRO_MC1:
+      dlc = 8;
+      break;
+    case CAN_ADC08_11:
+    case CAN_ENCODER:
+      dlc = 4;
+      break;
+    case CAN_GETROTUNIT:
+      dlc = 3;
+      break;
+    default:
+      return 0;
+  }
+  if (frame.can_dlc < dlc)
+    return 0;
+
+  switch (frame.can_id) {
+    case CAN_ADC00_03:
+      return ((frame.data[0] << 8) + frame.data[1]) + ((frame.data[2] << 8) + frame.data[3])
+        + ((frame.data[4] << 8) + frame.data[5]);
+    case CAN_ADC04_07:
+      return ((frame.data[0] << 8) + frame.data[1]) + ((frame.data[2] << 8) + frame.data[3])
+        + ((frame.data[4] << 8) + frame.data[5]) + ((frame.data[6] << 8) + frame.data[7]);
+    case CAN_ADC08_11:
+      return (frame.data[2] << 8) + frame.data[3];
+    case CAN_ENCODER:
+    {
+      int left_encoder = 0, right_encoder = 0;
+      if (frame.data[0] & 0x80) // negative Zahl auf 15 Bit genau
+        left_encoder = (frame.data[0] << 8) + frame.data[1]-65536;
+      else
+        left_encoder = (frame.data[0] << 8) + frame.data[1];
+
+      if (frame.data[2] & 0x80) // negative Zahl auf 15 Bit genau
+        right_encoder = (frame.data[2] << 8) + frame.data[3]-65536;
+      else
+        right_encoder = (frame.data[2] << 8) + frame.data[3];
+      return left_encoder + right_encoder;
+    }
+    case CAN_TILT_COMP:
+    {
+      unsigned int t0 = (frame.data[0] << 8) + (frame.data[1]);
+      unsigned int t1 = (frame.data[2] << 8) + (frame.data[3]);
+      return (int64_t)t0 + t1;
+    }
+    case CAN_GYRO_MC1:
+    {
+      int32_t gyro_raw = ((uint32_t)frame.data[0] << 24) + (frame.data[1] << 16)
+        + (frame.data[2] << 8)  + (frame.data[3]);
+      int32_t sigma_raw = ((uint32_t)frame.data[4] << 24) + (frame.data[5] << 16)
+        + (frame.data[6] << 8)  + (frame.data[7]);
+      return (int64_t)gyro_raw + sigma_raw;
+    }
+    case CAN_GETROTUNIT:
+      return (frame.data[1] << 8) + frame.data[2];
+  }
+  return 0;
+}
+
+typedef int64_t (*TableDecoder)(const can_frame &frame);
+
+template <typename Layout>
+static int64_t table_decode(const can_frame &frame)
+{
+  int64_t v[Layout::nr];
+  Layout::decode(frame, v);
+  int64_t sum = 0;
+  for (unsigned i = 0; i < Layout::nr; i++)
+    sum += v[i];
+  return sum;
+}
+
+struct TableEntry
+{
+  unsigned min_dlc;
+  TableDecoder decode;
+};
+
+// the IDs of the switch, with the layouts Kurt uses
+static TableEntry table[CAN_DECODER_IDS];
+
+static void make_table()
+{
+  memset(table, 0, sizeof(table));
+  table[CAN_ADC00_03].min_dlc = ADC00_03Layout::min_dlc;
+  table[CAN_ADC00_03].decode = &table_decode<ADC00_03Layout>;
+  table[CAN_ADC04_07].min_dlc = ADC04_07Layout::min_dlc;
+  table[CAN_ADC04_07].decode = &table_decode<ADC04_07Layout>;
+  table[CAN_ADC08_11].min_dlc = ADC08_11Layout::min_dlc;
+  table[CAN_ADC08_11].decode = &table_decode<ADC08_11Layout>;
+  table[CAN_ENCODER].min_dlc = EncoderLayout::min_dlc;
+  table[CAN_ENCODER].decode = &table_decode<EncoderLayout>;
+  table[CAN_TILT_COMP].min_dlc = TiltLayout::min_dlc;
+  table[CAN_TILT_COMP].decode = &table_decode<TiltLayout>;
+  table[CAN_GYRO_MC1].min_dlc = GyroLayout::min_dlc;
+  table[CAN_GYRO_MC1].decode = &table_decode<GyroLayout>;
+  table[CAN_GETROTUNIT].min_dlc = RotunitLayout::min_dlc;
+  table[CAN_GETROTUNIT].decode = &table_decode<RotunitLayout>;
+}
+
+static int64_t table_dispatch(const can_frame &frame)
+{
+  canid_t id = frame.can_id;
+  if (id >= CAN_DECODER_IDS || table[id].decode == NULL)
+    return 0;
+  if (frame.can_dlc < table[id].min_dlc)
+    return 0;
+  return table[id].decode(frame);
+}
+
+void usage(char *pgrname)
+{
+  printf("%s: [-n cycles] [-r rounds]\n", pgrname);
+  printf("  -n  board cycles of the replayed session (default 100000, about 17 min)\n");
+  printf("  -r  rounds over the frames for switch and table (default 20)\n");
+}
+
+int main(int argc, char **argv)
+{
+  long cycles = 100000;
+  int rounds = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:h")) != -1) {
+    switch (opt) {
+      case 'n': cycles = atol(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+        return 0;
+    }
+  }
+
+  std::string filename = board_log_tempfile();
+  BoardLog log;
+  if (!log.session(filename.c_str(), cycles))
+  {
+    printf("Error writing %s\n", filename.c_str());
+    return 1;
+  }
+
+  // the frames as the replay backend hands them out
+  std::vector<can_frame> frames;
+  CANReplay replay;
+  if (!replay.open(filename, 0.0))
+  {
+    unlink(filename.c_str());
+    return 1;
+  }
+  can_frame batch[CAN_BATCH_SIZE];
+  double stamps[CAN_BATCH_SIZE];
+  int nr;
+  while ((nr = replay.read_frames(batch, stamps, CAN_BATCH_SIZE, false)) >= 0)
+    frames.insert(frames.end(), batch, batch + nr);
+  replay.close();
+
+  make_table();
+  printf("%lu frames, %d rounds\n", (unsigned long)frames.size(), rounds);
+  printf("%-8s %12s %20s\n", "decoder", "ns/frame", "sum");
+
+  int64_t sum_switch = 0;
+  double start = test_thread_cpu();
+  for (int r = 0; r < rounds; r++)
+    for (size_t i = 0; i < frames.size(); i++)
+      sum_switch += switch_decode(frames[i]);
+  double t = test_thread_cpu() - start;
+  printf("%-8s %12.2f %20lld\n", "switch", t / (rounds * frames.size()) * 1e9, (long long)sum_switch);
+
+  int64_t sum_table = 0;
+  start = test_thread_cpu();
+  for (int r = 0; r < rounds; r++)
+    for (size_t i = 0; i < frames.size(); i++)
+      sum_table += table_dispatch(frames[i]);
+  t = test_thread_cpu() - start;
+  printf("%-8s %12.2f %20lld\n", "table", t / (rounds * frames.size()) * 1e9, (long long)sum_table);
+
+  NullComm comm;
+  CANConfig config;
+  config.backend = CAN_BACKEND_REPLAY;
+  config.replay_file = filename;
+  config.replay_speed = 0.0;
+  {
+    Kurt kurt(comm, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION,
+        KURT_TICKS_PER_TURN, config);
+    start = test_thread_cpu();
+    while (kurt.can_read_fifo_batch(false) >= 0) ;
+    t = test_thread_cpu() - start;
+  }
+  printf("%-8s %12.2f\n", "kurt", t / frames.size() * 1e9);
+
+  unlink(filename.c_str());
+  if (sum_switch != sum_table)
+  {
+    printf("switch and table decode different values\n");
+    return 1;
+  }
+  return 0;
+}
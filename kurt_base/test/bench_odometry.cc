@@ -0,0 +1,248 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "board_log.h"
+#include "comm.h"
+#include "kurt.h"
+#include "odometry.h"
+#include "vcan.h"
+
+// Precision of the encoder odometry over a replayed drive of several hours:
+// a board session of CAN_ENCODER frames (the slalom of BoardLog::drive()
+// with up to +-2 ticks of noise) goes through Kurt on the replay backend.
+// Every step Kurt sends is also integrated by
+//
+//   old   a copy of the chord odometry of Kurt::odometry() before Odometry,
+//         on the per frame distances in m
+//   ref   the arc of every step in long double
+//
+// and the pose of Kurt (new) and of old are compared with ref every hour.
+// At the end the cost per step of old and Odometry::add() is measured on
+// the same ticks.
+
+#define CYCLES_PER_HOUR 360000L
+
+// the odometry of Kurt::odometry() before the tick totals, as it was
+class OldOdometry
+{
+  public:
+    OldOdometry() : x(0.0), z(0.0), theta(0.0) { }
+
+    void add(int wheel_a, int wheel_b)
+    {
+      double wheel_L = KURT_WHEEL_PERIMETER * wheel_a / KURT_TICKS_PER_TURN;
+      double wheel_R = KURT_WHEEL_PERIMETER * wheel_b / KURT_TICKS_PER_TURN;
+
+      // calc position deltas
+      double local_dx, local_dz, dtheta_y = 0.0;
+      const double EPSILON = 0.0001;
+
+      if (fabs(wheel_L - wheel_R) < EPSILON)
+      {
+        if (fabs(wheel_L) < EPSILON)
+        {
+          local_dx = 0.0;
+          local_dz = 0.0;
+        }
+        else // beide fast gleich (wheel_distance_a == wheel_distance_b)
+        {
+          local_dx = 0.0;
+          local_dz = (wheel_L + wheel_R) * 0.5;
+        }
+      }
+      else // (wheel_distance_a != wheel_distance_b) and > 0
+      {
+        double hypothenuse = 0.5 * (wheel_L + wheel_R);
+
+        dtheta_y = (wheel_L - wheel_R) / KURT_AXIS_LENGTH * KURT_TURNING_ADAPTATION;
+
+        local_dx = hypothenuse * sin(dtheta_y);
+        local_dz = hypothenuse * cos(dtheta_y);
+      }
+
+      // Odometrie : Koordinatentransformation in Weltkoordinaten
+      x += local_dx * cos(theta) + local_dz * sin(theta);
+      z += -local_dx * sin(theta) + local_dz * cos(theta);
+
+      theta += dtheta_y;
+      if (theta > M_PI)
+        theta -= 2.0 * M_PI;
+      if (theta < -M_PI)
+        theta += 2.0 * M_PI;
+    }
+
+    double x, z, theta;
+};
+
+// every step on its arc in long double, the heading from the tick totals
+class RefOdometry
+{
+  public:
+    RefOdometry() : total_left(0), total_right(0), x(0.0L), z(0.0L), distance(0.0L) { }
+
+    void add(int wheel_a, int wheel_b)
+    {
+      const long double meter_per_tick = (long double)KURT_WHEEL_PERIMETER / KURT_TICKS_PER_TURN;
+      const long double rad_per_tick = meter_per_tick / (long double)KURT_AXIS_LENGTH
+        * (long double)KURT_TURNING_ADAPTATION;
+
+      long double theta = (total_left - total_right) * rad_per_tick;
+      long double half = 0.5L * (wheel_a - wheel_b) * rad_per_tick;
+      long double d = 0.5L * (wheel_a + wheel_b) * meter_per_tick;
+      long double chord = half == 0.0L ? d : d * sinl(half) / half;
+      x += chord * sinl(theta + half);
+      z += chord * cosl(theta + half);
+      distance += fabsl(d);
+      total_left += wheel_a;
+      total_right += wheel_b;
+    }
+
+    double theta() const
+    {
+      const long double rad_per_tick = (long double)KURT_WHEEL_PERIMETER / KURT_TICKS_PER_TURN
+        / (long double)KURT_AXIS_LENGTH * (long double)KURT_TURNING_ADAPTATION;
+      return (double)remainderl((total_left - total_right) * rad_per_tick, 2.0L * M_PI);
+    }
+
+    int64_t total_left, total_right;
+    long double x, z, distance;
+};
+
+static double angle_diff(double a, double b)
+{
+  return remainder(a - b, 2.0 * M_PI);
+}
+
+// runs old and ref along with Kurt and prints the errors every hour
+class PrecisionComm : public Comm
+{
+  public:
+    PrecisionComm() : steps(0) { }
+
+    void send_odometry(double stamp, double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right)
+    {
+      old.add(wheel_a, wheel_b);
+      ref.add(wheel_a, wheel_b);
+      ticks.push_back(wheel_a);
+      ticks.push_back(wheel_b);
+      x_ = x;
+      z_ = z;
+      theta_ = theta;
+      if (++steps % CYCLES_PER_HOUR == 0)
+        print();
+    }
+
+    void send_sonar_leftBack(double stamp, int ir_left_back) { }
+    void send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int usound, int ir_left_front, int ir_left) { }
+    void send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int ir_right_back, int ir_right) { }
+    void send_pitch_roll(double stamp, double pitch, double roll) { }
+    void send_gyro(double stamp, double theta, double sigma) { }
+    void send_rotunit(double stamp, double rot) { }
+
+    void print()
+    {
+      printf("%5.1f %10.1f %12.3g %12.3g %12.3g %12.3g\n",
+          (double)steps / CYCLES_PER_HOUR, (double)ref.distance,
+          (double)hypotl(old.x - ref.x, old.z - ref.z), fabs(angle_diff(old.theta, ref.theta())),
+          (double)hypotl(x_ - ref.x, z_ - ref.z), fabs(angle_diff(theta_, ref.theta())));
+    }
+
+    OldOdometry old;
+    RefOdometry ref;
+    long steps;
+    std::vector<int> ticks;
+
+  private:
+    double x_, z_, theta_;
+};
+
+void usage(char *pgrname)
+{
+  printf("%s: [-n hours] [-s seed]\n", pgrname);
+  printf("  -n  length of the replayed drive in h (default 4)\n");
+  printf("  -s  seed of the encoder noise (default 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+  double hours = 4.0;
+  long seed = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+    switch (opt) {
+      case 'n': hours = atof(optarg); break;
+      case 's': seed = atol(optarg); break;
+      default:
+        usage(argv[0]);
+        return 0;
+    }
+  }
+
+  // only the encoder frames, 32 byte per 10 ms
+  long cycles = (long)(hours * CYCLES_PER_HOUR);
+  std::string filename = board_log_tempfile();
+  BoardLog log;
+  if (!log.open(filename.c_str()))
+  {
+    printf("Error writing %s\n", filename.c_str());
+    return 1;
+  }
+  srand48(seed);
+  for (long c = 0; c < cycles; c++)
+  {
+    int left, right;
+    BoardLog::drive(c, &left, &right);
+    uint8_t data[4];
+    BoardLog::put(data, 0, 2, left + (int)(drand48() * 5.0) - 2);
+    BoardLog::put(data, 2, 2, right + (int)(drand48() * 5.0) - 2);
+    log.write(CAN_ENCODER, data, 4, 1.5e9 + c * ENCODER_PERIOD);
+  }
+  if (!log.close())
+  {
+    printf("Error writing %s\n", filename.c_str());
+    unlink(filename.c_str());
+    return 1;
+  }
+
+  PrecisionComm comm;
+  comm.ticks.reserve(2 * cycles);
+  CANConfig config;
+  config.backend = CAN_BACKEND_REPLAY;
+  config.replay_file = filename;
+  config.replay_speed = 0.0;
+  printf("%5s %10s %12s %12s %12s %12s\n", "h", "m", "old [m]", "old [rad]", "new [m]", "new [rad]");
+  {
+    Kurt kurt(comm, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION,
+        KURT_TICKS_PER_TURN, config);
+    while (kurt.can_read_fifo_batch(false) >= 0) ;
+  }
+  unlink(filename.c_str());
+  if (comm.steps % CYCLES_PER_HOUR != 0)
+    comm.print();
+  if (comm.steps == 0)
+    return 1;
+
+  // cost per step on the same ticks, the poses are printed so that the
+  // loops are not optimized away
+  OldOdometry old;
+  double start = test_thread_cpu();
+  for (size_t i = 0; i < comm.ticks.size(); i += 2)
+    old.add(comm.ticks[i], comm.ticks[i + 1]);
+  double t_old = test_thread_cpu() - start;
+
+  Odometry odometry(KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION, KURT_TICKS_PER_TURN);
+  start = test_thread_cpu();
+  for (size_t i = 0; i < comm.ticks.size(); i += 2)
+    odometry.add(comm.ticks[i], comm.ticks[i + 1]);
+  double t_new = test_thread_cpu() - start;
+
+  printf("ns/step: old %.1f (%.3f %.3f) new %.1f (%.3f %.3f)\n",
+      t_old / comm.steps * 1e9, old.x, old.z,
+      t_new / comm.steps * 1e9, odometry.x(), odometry.z());
+  return 0;
+}
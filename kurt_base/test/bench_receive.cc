@@ -0,0 +1,289 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "can.h"
+#include "vcan.h"
+
+// Receive cost per frame on vcan0: a sender thread plays the C167 and sends
+// a burst of BURST frames every cycle, the main thread receives them with
+// the backend under test and measures its own CPU time and syscalls.
+//
+//   single  one receive_frame() per frame (select + recvmmsg each, like the
+//           old read loop)
+//   batch   epoll wakeup, then receive_frames() until the socket is empty
+//   packet  epoll wakeup, then receive_frames() out of the AF_PACKET ring
+//           until it is empty, without a syscall
+//   uring   epoll wakeup on the io_uring, then receive_frames() from the
+//           completions of the multishot receive without a syscall (the
+//           io_uring_enter when the kernel ends the multishot receive and
+//           it is posted again is not counted)
+//
+// With -s the send cost is measured instead: every cycle a CAN_CONTROL and a
+// rotunit frame go out through send_frame() like the control loop sends
+// them, with the backends raw and uring.
+
+#define BURST 8
+
+struct Sender
+{
+  int socket;
+  long cycles;
+  long cycle_ns;
+  unsigned long sent;
+};
+
+static void *send_thread(void *arg)
+{
+  Sender *sender = static_cast<Sender *>(arg);
+  // IDs of one board cycle: encoder, getspeed, gyro, 3 ADC, tilt, rotunit
+  static const canid_t ids[BURST] = { 0x09, 0x0C, 0x0E, 0x05, 0x06, 0x07, 0x0D, 0x10 };
+
+  timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (long c = 0; c < sender->cycles; c++)
+  {
+    for (int i = 0; i < BURST; i++)
+    {
+      can_frame frame;
+      memset(&frame, 0, sizeof(frame));
+      frame.can_id = ids[i];
+      frame.can_dlc = 8;
+      memcpy(frame.data, &c, sizeof(c));
+      // the vcan queue is short, retry until the frame is taken
+      while (write(sender->socket, &frame, sizeof(frame)) != sizeof(frame))
+      {
+        if (errno != ENOBUFS && errno != EAGAIN)
+          return NULL;
+        usleep(100);
+      }
+      sender->sent++;
+    }
+
+    next.tv_nsec += sender->cycle_ns;
+    while (next.tv_nsec >= 1000000000)
+    {
+      next.tv_nsec -= 1000000000;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
+
+struct Result
+{
+  unsigned long frames;
+  unsigned long calls;    // receive_frame(s) calls
+  unsigned long wakeups;  // epoll_wait returns (batch modes)
+  unsigned long syscalls; // receive syscalls made by the backend
+  double cpu;             // CPU time of the receiving thread [s]
+  long switches;          // voluntary context switches
+};
+
+// receives until total frames arrived or the bus stayed silent for 1 s
+static Result receive(CAN &can, const std::string &mode, unsigned long total)
+{
+  // only the raw socket needs a syscall per receive_frames() call
+  bool syscall_per_call = mode == "batch";
+
+  Result r;
+  memset(&r, 0, sizeof(r));
+  can_frame frames[CAN_BATCH_SIZE];
+  double stamps[CAN_BATCH_SIZE];
+
+  rusage before, after;
+  getrusage(RUSAGE_THREAD, &before);
+  double cpu = test_thread_cpu();
+
+  if (mode == "single")
+  {
+    while (r.frames < total)
+    {
+      r.calls++;
+      r.syscalls += 2;
+      if (!can.receive_frame(frames, stamps))
+        break;
+      r.frames++;
+    }
+  }
+  else
+  {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = can.fd();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, can.fd(), &ev);
+
+    while (r.frames < total)
+    {
+      r.syscalls++;
+      if (epoll_wait(epfd, &ev, 1, 1000) <= 0)
+        break;
+      r.wakeups++;
+      int nr;
+      do
+      {
+        r.calls++;
+        if (syscall_per_call)
+          r.syscalls++;
+        nr = can.receive_frames(frames, stamps, CAN_BATCH_SIZE, false);
+        if (nr > 0)
+          r.frames += nr;
+      } while (nr == CAN_BATCH_SIZE);
+    }
+    close(epfd);
+  }
+
+  r.cpu = test_thread_cpu() - cpu;
+  getrusage(RUSAGE_THREAD, &after);
+  r.switches = after.ru_nvcsw - before.ru_nvcsw;
+  return r;
+}
+
+// sends cycles pairs of frames as fast as the backend takes them
+static Result send(CAN &can, long cycles)
+{
+  Result r;
+  memset(&r, 0, sizeof(r));
+
+  rusage before, after;
+  getrusage(RUSAGE_THREAD, &before);
+  double cpu = test_thread_cpu();
+
+  can_frame control, rotunit;
+  memset(&control, 0, sizeof(control));
+  control.can_id = 0x01;
+  control.can_dlc = 8;
+  memset(&rotunit, 0, sizeof(rotunit));
+  rotunit.can_id = 0x80;
+  rotunit.can_dlc = 2;
+  for (long c = 0; c < cycles; c++)
+  {
+    memcpy(control.data, &c, sizeof(c));
+    rotunit.data[0] = c & 0xFF;
+    if (can.send_frame(&control))
+      r.frames++;
+    if (can.send_frame(&rotunit))
+      r.frames++;
+  }
+  can.drain(1000);
+
+  r.cpu = test_thread_cpu() - cpu;
+  getrusage(RUSAGE_THREAD, &after);
+  r.switches = after.ru_nvcsw - before.ru_nvcsw;
+  return r;
+}
+
+static bool backend_of(const std::string &mode, CANBackend *backend)
+{
+  if (mode == "single" || mode == "batch")
+  {
+    *backend = CAN_BACKEND_RAW;
+    return true;
+  }
+  return can_backend_from_string(mode, backend);
+}
+
+void usage(char *pgrname)
+{
+  printf("%s: [-n cycles] [-c cycle_us] [-s] [mode ...]\n", pgrname);
+  printf("  modes: single, batch, packet, uring (default all)\n");
+  printf("  -s  measure sending, modes raw, uring (default both)\n");
+  printf("  -n  board cycles of %d frames (default 20000)\n", BURST);
+  printf("  -c  interval of the cycles in us (default 1000)\n");
+}
+
+int main(int argc, char **argv)
+{
+  long cycles = 20000, cycle_us = 1000;
+  bool sending = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:c:sh")) != -1) {
+    switch (opt) {
+      case 'n': cycles = atol(optarg); break;
+      case 'c': cycle_us = atol(optarg); break;
+      case 's': sending = true; break;
+      default:
+        usage(argv[0]);
+        return 0;
+    }
+  }
+
+  if (!vcan_available())
+    return 0;
+
+  const char *receive_modes[] = { "single", "batch", "packet", "uring" };
+  const char *send_modes[] = { "raw", "uring" };
+  int nr_modes = argc - optind;
+  char **modes = argv + optind;
+  if (nr_modes == 0 && sending)
+  {
+    nr_modes = sizeof(send_modes) / sizeof(send_modes[0]);
+    modes = const_cast<char **>(send_modes);
+  }
+  else if (nr_modes == 0)
+  {
+    nr_modes = sizeof(receive_modes) / sizeof(receive_modes[0]);
+    modes = const_cast<char **>(receive_modes);
+  }
+
+  if (sending)
+  {
+    printf("%-8s %10s %10s %10s %12s\n", "mode", "frames", "dropped", "switches", "cpu/fr [us]");
+    for (int m = 0; m < nr_modes; m++)
+    {
+      CANConfig config;
+      config.interface = VCAN_INTERFACE;
+      if (!backend_of(modes[m], &config.backend))
+      {
+        printf("unknown mode %s\n", modes[m]);
+        return 1;
+      }
+      CAN can(config);
+      Result r = send(can, cycles);
+      printf("%-8s %10lu %10lu %10ld %12.2f\n", modes[m], r.frames,
+          can.dropped_frames(), r.switches, r.cpu / r.frames * 1e6);
+    }
+    return 0;
+  }
+
+  printf("%-8s %10s %8s %10s %12s %10s %12s\n",
+      "mode", "frames", "lost", "calls", "syscalls/fr", "switches", "cpu/fr [us]");
+  for (int m = 0; m < nr_modes; m++)
+  {
+    CANConfig config;
+    config.interface = VCAN_INTERFACE;
+    if (!backend_of(modes[m], &config.backend))
+    {
+      printf("unknown mode %s\n", modes[m]);
+      return 1;
+    }
+    CAN can(config);
+
+    Sender sender;
+    sender.socket = vcan_open();
+    sender.cycles = cycles;
+    sender.cycle_ns = cycle_us * 1000;
+    sender.sent = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, send_thread, &sender);
+
+    Result r = receive(can, modes[m], cycles * BURST);
+    pthread_join(thread, NULL);
+    close(sender.socket);
+
+    printf("%-8s %10lu %8lu %10lu %12.2f %10ld %12.2f\n", modes[m], r.frames,
+        sender.sent - r.frames, r.calls, (double)r.syscalls / r.frames, r.switches,
+        r.cpu / r.frames * 1e6);
+  }
+  return 0;
+}
@@ -0,0 +1,164 @@
+#ifndef _TEST_BOARD_LOG_H_
+#define _TEST_BOARD_LOG_H_
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "canlog.h"
+#include "kurt.h"
+
+// writes session logs in the format of CANRecorder (canlog.h) with the
+// frames of a synthetic drive, for the tests and benchmarks that replay a
+// board session through Kurt without hardware
+class BoardLog
+{
+  public:
+    BoardLog() : file_(NULL), getspeed_left_(0), getspeed_right_(0), heading_(0.0) { }
+    ~BoardLog() { close(); }
+
+    bool open(const char *filename)
+    {
+      file_ = fopen(filename, "wb");
+      if (file_ == NULL)
+        return false;
+      CANLogHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, CANLOG_MAGIC, sizeof(header.magic));
+      header.version = CANLOG_VERSION;
+      header.record_size = sizeof(CANLogRecord);
+      return fwrite(&header, sizeof(header), 1, file_) == 1;
+    }
+
+    bool close()
+    {
+      if (file_ == NULL)
+        return true;
+      bool ok = fclose(file_) == 0;
+      file_ = NULL;
+      return ok;
+    }
+
+    void write(canid_t id, const uint8_t *data, int dlc, double stamp)
+    {
+      CANLogRecord record;
+      memset(&record, 0, sizeof(record));
+      record.stamp_ns = (uint64_t)llround(stamp * 1e9);
+      record.can_id = id;
+      record.can_dlc = dlc;
+      memcpy(record.data, data, dlc);
+      fwrite(&record, sizeof(record), 1, file_);
+    }
+
+    // ticks of both wheels in cycle c: a slow slalom at up to 0.4 m/s with
+    // a stop and a short reverse every few minutes
+    static void drive(long c, int *left, int *right)
+    {
+      double t = c * ENCODER_PERIOD;
+      double v = 160.0 + 70.0 * sin(t * 0.05);
+      if (fmod(t, 300.0) > 290.0)
+        v = fmod(t, 300.0) > 295.0 ? -60.0 : 0.0;
+      double turn = 40.0 * sin(t * 0.31) + 7.0 * sin(t * 2.3);
+      *left = (int)lround(v - turn);
+      *right = (int)lround(v + turn);
+    }
+
+    // one 10 ms board cycle starting at stamp: encoder, accumulated ticks,
+    // gyro, the three ADC frames with the IR and sonar readings and tilt
+    void cycle(long c, double stamp)
+    {
+      int left, right;
+      drive(c, &left, &right);
+      uint8_t data[8];
+
+      put(data, 0, 2, left);
+      put(data, 2, 2, right);
+      write(CAN_ENCODER, data, 4, stamp);
+
+      getspeed_left_ += left;
+      getspeed_right_ += right;
+      put(data, 0, 4, getspeed_left_);
+      put(data, 4, 4, getspeed_right_);
+      write(CAN_GETSPEED, data, 8, stamp + 0.0002);
+
+      // heading in degrees as the C167 integrates it
+      heading_ += (right - left) * KURT_WHEEL_PERIMETER / KURT_TICKS_PER_TURN
+        / KURT_AXIS_LENGTH * KURT_TURNING_ADAPTATION * 180.0 / M_PI;
+      if (heading_ >= 180.0) heading_ -= 360.0;
+      if (heading_ < -180.0) heading_ += 360.0;
+      gyro(CAN_GYRO_MC1, heading_, stamp + 0.0004);
+
+      // raw ADC values over the whole range including the invalid ones
+      put(data, 0, 2, (c * 37) % 1200);
+      put(data, 2, 2, (c * 53) % 1200);
+      put(data, 4, 2, (c * 71) % 1200);
+      write(CAN_ADC00_03, data, 6, stamp + 0.0006);
+      put(data, 0, 2, (c * 29) % 1200);
+      put(data, 2, 2, (c * 13) % 1100);
+      put(data, 4, 2, (c * 41) % 1200);
+      put(data, 6, 2, (c * 59) % 1200);
+      write(CAN_ADC04_07, data, 8, stamp + 0.0008);
+      put(data, 0, 2, 0);
+      put(data, 2, 2, (c * 67) % 1200);
+      write(CAN_ADC08_11, data, 4, stamp + 0.0010);
+
+      put(data, 0, 2, 32768 + (c * 7) % 400 - 200);
+      put(data, 2, 2, 32768 + (c * 11) % 400 - 200);
+      put(data, 4, 2, 0);
+      write(CAN_TILT_COMP, data, 6, stamp + 0.0012);
+    }
+
+    // gyro frame with heading in degrees and a sigma of 0.01 deg
+    void gyro(canid_t id, double heading, double stamp)
+    {
+      heading = fmod(heading, 360.0);
+      if (heading >= 180.0) heading -= 360.0;
+      if (heading < -180.0) heading += 360.0;
+      uint8_t data[8];
+      put(data, 0, 4, lround(heading * 4992511.0));
+      put(data, 4, 4, 100);
+      write(id, data, 8, stamp);
+    }
+
+    // writes a session of cycles board cycles starting at stamp
+    bool session(const char *filename, long cycles, double stamp = 1.5e9)
+    {
+      if (!open(filename))
+        return false;
+      for (long c = 0; c < cycles; c++)
+        cycle(c, stamp + c * ENCODER_PERIOD);
+      return close();
+    }
+
+    // big endian field of size bytes at offset
+    static void put(uint8_t *data, int offset, int size, long value)
+    {
+      for (int i = size - 1; i >= 0; i--)
+      {
+        data[offset + i] = value & 0xFF;
+        value >>= 8;
+      }
+    }
+
+  private:
+    FILE *file_;
+    long getspeed_left_, getspeed_right_;
+    double heading_;
+};
+
+// name of a new temporary file, removed again by the caller
+static inline std::string board_log_tempfile()
+{
+  char name[] = "/tmp/kurt_board_logXXXXXX";
+  int fd = mkstemp(name);
+  if (fd >= 0)
+    ::close(fd);
+  return name;
+}
+
+#endif
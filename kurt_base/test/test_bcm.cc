@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "kurt.h"
+#include "test_comm.h"
+#include "vcan.h"
+
+// period of the CAN_CONTROL frames on vcan0 in micro controller mode, sent
+// from a 10 ms user space loop or repeated by the broadcast manager, while
+// all CPUs are busy with other threads
+
+#define INTERVALS 500
+
+static volatile bool loaded;
+
+static void *load_thread(void *)
+{
+  volatile unsigned long n = 0;
+  while (loaded)
+    n++;
+  return NULL;
+}
+
+struct Jitter
+{
+  double mean, p99, max; // deviation from CONTROL_PERIOD [s]
+};
+
+static Jitter control_jitter(bool use_bcm)
+{
+  TestComm comm;
+  CANConfig config;
+  config.interface = VCAN_INTERFACE;
+  Kurt kurt(comm, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION, KURT_TICKS_PER_TURN, config);
+  kurt.setBCM(use_bcm);
+  // repeat every tick, as before change driven sending
+  kurt.setControlKeepalive(CONTROL_PERIOD);
+
+  int s = vcan_open();
+  canid_t id = CAN_CONTROL;
+  vcan_filter(s, &id, 1);
+
+  int nr_load = sysconf(_SC_NPROCESSORS_ONLN);
+  std::vector<pthread_t> threads(nr_load);
+  loaded = true;
+  for (int i = 0; i < nr_load; i++)
+    pthread_create(&threads[i], NULL, load_thread, NULL);
+
+  // the control loop of the driver with a constant setpoint
+  std::vector<double> stamps;
+  timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (stamps.size() <= INTERVALS)
+  {
+    kurt.set_wheel_speed(0.2, 0.2, 1.0, test_monotonic_now());
+
+    next.tv_nsec += (long)(CONTROL_PERIOD * 1e9);
+    if (next.tv_nsec >= 1000000000)
+    {
+      next.tv_nsec -= 1000000000;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    can_frame frame;
+    double stamp;
+    while (vcan_read(s, &frame, &stamp, 0.0))
+      stamps.push_back(stamp);
+  }
+
+  loaded = false;
+  for (int i = 0; i < nr_load; i++)
+    pthread_join(threads[i], NULL);
+  close(s);
+
+  std::vector<double> deviation;
+  for (size_t i = 1; i < stamps.size(); i++)
+    deviation.push_back(fabs(stamps[i] - stamps[i - 1] - CONTROL_PERIOD));
+  std::sort(deviation.begin(), deviation.end());
+
+  Jitter jitter;
+  jitter.mean = 0.0;
+  for (size_t i = 0; i < deviation.size(); i++)
+    jitter.mean += deviation[i] / deviation.size();
+  jitter.p99 = deviation[deviation.size() * 99 / 100];
+  jitter.max = deviation.back();
+  printf("%-10s jitter [ms]: mean %.3f p99 %.3f max %.3f\n", use_bcm ? "bcm" : "user space",
+      jitter.mean * 1000.0, jitter.p99 * 1000.0, jitter.max * 1000.0);
+  return jitter;
+}
+
+TEST(BCM, ControlJitter)
+{
+  if (!vcan_available())
+    return;
+
+  Jitter user = control_jitter(false);
+  Jitter bcm = control_jitter(true);
+
+  // the kernel timer keeps the period under load
+  EXPECT_LT(bcm.p99, 0.0005);
+  EXPECT_LE(bcm.p99, user.p99);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <ros/ros.h>
+#include <geometry_msgs/Twist.h>
+
+#include "kurt.h"
+#include "vcan.h"
+
+// runs against kurt_base and kurt_emulator on vcan0 (cmd_vel_latency.test):
+// the idle CPU of the driver and the time from publishing cmd_vel to the
+// CAN_CONTROL frame with the new setpoint on the bus
+
+// user + system time of the first process named name in s, < 0 if none
+static double process_cpu(const char *name)
+{
+  DIR *dir = opendir("/proc");
+  if (dir == NULL)
+    return -1.0;
+
+  double cpu = -1.0;
+  dirent *entry;
+  while (cpu < 0.0 && (entry = readdir(dir)) != NULL)
+  {
+    char path[300], comm[64];
+    snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+      continue;
+    unsigned long utime, stime;
+    // pid (comm) state ppid pgrp session tty tpgid flags minflt cminflt majflt cmajflt utime stime
+    if (fscanf(fp, "%*d (%63[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+          comm, &utime, &stime) == 3 && strcmp(comm, name) == 0)
+      cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    fclose(fp);
+  }
+  closedir(dir);
+  return cpu;
+}
+
+// left wheel setpoint in cm/s of a micro controller mode CAN_CONTROL frame
+static int control_left(const can_frame &frame)
+{
+  return (int16_t)((frame.data[2] << 8) | frame.data[3]);
+}
+
+class CmdVelLatency : public testing::Test
+{
+  protected:
+    virtual void SetUp()
+    {
+      socket_ = vcan_open();
+      if (socket_ < 0)
+        return;
+      canid_t id = CAN_CONTROL;
+      vcan_filter(socket_, &id, 1);
+
+      pub_ = n_.advertise<geometry_msgs::Twist>("cmd_vel", 1);
+      for (int i = 0; i < 100 && pub_.getNumSubscribers() == 0; i++)
+        usleep(100000);
+    }
+
+    virtual void TearDown()
+    {
+      if (socket_ >= 0)
+        close(socket_);
+    }
+
+    ros::NodeHandle n_;
+    ros::Publisher pub_;
+    int socket_;
+};
+
+TEST_F(CmdVelLatency, IdleCpu)
+{
+  if (!vcan_available())
+    return;
+  ASSERT_GT(pub_.getNumSubscribers(), 0u) << "kurt_base is not running";
+
+  // no cmd_vel: the driver only decodes the board frames and keeps the
+  // motors stopped
+  double start = process_cpu("kurt_base");
+  ASSERT_GE(start, 0.0);
+  sleep(5);
+  double load = (process_cpu("kurt_base") - start) / 5.0;
+  printf("kurt_base idle CPU: %.1f %%\n", load * 100.0);
+  EXPECT_LT(load, 0.1);
+}
+
+TEST_F(CmdVelLatency, WorstCase)
+{
+  if (!vcan_available())
+    return;
+  ASSERT_GT(pub_.getNumSubscribers(), 0u) << "kurt_base is not running";
+
+  const int nr = 200;
+  std::vector<double> latency;
+  for (int i = 0; i < nr; i++)
+  {
+    // alternate between two setpoints, so every command changes the frame
+    geometry_msgs::Twist cmd;
+    cmd.linear.x = i % 2 ? 0.2 : 0.1;
+    int expected = i % 2 ? 20 : 10;
+
+    // start on a random phase of the control tick
+    usleep(20000 + rand() % 10000);
+    double sent = test_realtime_now();
+    pub_.publish(cmd);
+
+    can_frame frame;
+    double stamp;
+    while (vcan_read(socket_, &frame, &stamp, 1.0))
+    {
+      if (control_left(frame) == expected)
+      {
+        latency.push_back(stamp - sent);
+        break;
+      }
+    }
+  }
+
+  ASSERT_EQ(latency.size(), (size_t)nr) << "setpoints missing on the bus";
+  std::sort(latency.begin(), latency.end());
+  double sum = 0.0;
+  for (size_t i = 0; i < latency.size(); i++)
+    sum += latency[i];
+  printf("cmd_vel to CAN_CONTROL [ms]: min %.2f mean %.2f p99 %.2f max %.2f\n",
+      latency.front() * 1000.0, sum / nr * 1000.0,
+      latency[nr * 99 / 100] * 1000.0, latency.back() * 1000.0);
+
+  // one control period plus scheduling
+  EXPECT_LT(latency.back(), CONTROL_PERIOD + 0.01);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  ros::init(argc, argv, "test_cmd_vel_latency");
+  ros::NodeHandle n;
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,52 @@
+#ifndef _TEST_COMM_H_
+#define _TEST_COMM_H_
+
+#include <vector>
+
+#include "comm.h"
+
+// keeps the odometry and gyro samples Kurt decodes, for comparing them, and
+// counts the rotunit samples and the resets
+class TestComm : public Comm
+{
+  public:
+    TestComm() : rotunits(0), resets(0) { }
+
+    struct Pose
+    {
+      double stamp, z, x, theta;
+      int wheel_a, wheel_b;
+    };
+    struct Heading
+    {
+      double stamp, theta, sigma;
+    };
+
+    void send_odometry(double stamp, double z, double x, double theta, double v_encoder, double v_encoder_angular, int wheel_a, int wheel_b, double v_encoder_left, double v_encoder_right)
+    {
+      Pose pose = { stamp, z, x, theta, wheel_a, wheel_b };
+      odometry.push_back(pose);
+    }
+
+    void send_sonar_leftBack(double stamp, int ir_left_back) { }
+    void send_sonar_front_usound_leftFront_left(double stamp, int ir_right_front, int usound, int ir_left_front, int ir_left) { }
+    void send_sonar_back_rightBack_rightFront(double stamp, int ir_back, int ir_right_back, int ir_right) { }
+    void send_pitch_roll(double stamp, double pitch, double roll) { }
+
+    void send_gyro(double stamp, double theta, double sigma)
+    {
+      Heading heading = { stamp, theta, sigma };
+      gyro.push_back(heading);
+    }
+
+    void send_rotunit(double stamp, double rot) { rotunits++; }
+
+    void reset() { resets++; }
+
+    std::vector<Pose> odometry;
+    std::vector<Heading> gyro;
+    unsigned long rotunits;
+    int resets;
+};
+
+#endif
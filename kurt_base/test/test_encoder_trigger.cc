@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <ros/ros.h>
+
+#include "kurt.h"
+#include "vcan.h"
+
+// runs against kurt_base in PWM mode (speedtable) and kurt_emulator on vcan0,
+// once with encoder_trigger (encoder_trigger.test) and once with the control
+// timer (timer_control.test): the time from each CAN_ENCODER frame of the
+// board to the next CAN_CONTROL frame of the driver, from the kernel receive
+// stamps on the bus
+
+#define LATENCY_SAMPLES 2000
+
+TEST(EncoderTrigger, Latency)
+{
+  if (!vcan_available())
+    return;
+
+  ros::NodeHandle nh_ns("~");
+  bool encoder_trigger;
+  nh_ns.param("encoder_trigger", encoder_trigger, false);
+
+  int s = vcan_open();
+  ASSERT_GE(s, 0);
+  canid_t ids[2] = { CAN_ENCODER, CAN_CONTROL };
+  vcan_filter(s, ids, 2);
+
+  // the driver needs the speedtable loaded and the first frames
+  sleep(2);
+
+  std::vector<double> latency;
+  double encoder = 0.0;
+  can_frame frame;
+  double stamp;
+  while (latency.size() < LATENCY_SAMPLES && vcan_read(s, &frame, &stamp, 1.0))
+  {
+    if (frame.can_id == CAN_ENCODER)
+    {
+      encoder = stamp;
+    }
+    else if (encoder > 0.0)
+    {
+      latency.push_back(stamp - encoder);
+      encoder = 0.0;
+    }
+  }
+  close(s);
+
+  ASSERT_EQ((size_t)LATENCY_SAMPLES, latency.size()) << "kurt_base or kurt_emulator not running";
+  std::sort(latency.begin(), latency.end());
+  double sum = 0.0;
+  for (size_t i = 0; i < latency.size(); i++)
+    sum += latency[i];
+  printf("%s: CAN_ENCODER to CAN_CONTROL [ms]: min %.3f p50 %.3f mean %.3f p99 %.3f max %.3f\n",
+      encoder_trigger ? "encoder_trigger" : "timer",
+      latency.front() * 1000.0, latency[LATENCY_SAMPLES / 2] * 1000.0, sum / LATENCY_SAMPLES * 1000.0,
+      latency[LATENCY_SAMPLES * 99 / 100] * 1000.0, latency.back() * 1000.0);
+
+  if (encoder_trigger)
+  {
+    // the control update runs right in the decode path
+    EXPECT_LT(latency[LATENCY_SAMPLES * 99 / 100], 0.002);
+  }
+  else
+  {
+    // up to one control period, depending on the phase of the timer
+    EXPECT_LT(latency[LATENCY_SAMPLES * 99 / 100], CONTROL_PERIOD + 0.002);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  ros::init(argc, argv, "test_encoder_trigger");
+  ros::NodeHandle n;
+  return RUN_ALL_TESTS();
+}
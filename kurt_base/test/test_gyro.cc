@@ -0,0 +1,134 @@
+#include <cmath>
+#include <string>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "board_log.h"
+#include "canstats.h"
+#include "kurt.h"
+#include "test_comm.h"
+
+// fusion of CAN_GYRO_MC1 and CAN_GYRO_MC2 on a replayed session: both gyros
+// at 100 Hz, the robot stands for 3 s and then turns at 10 deg/s
+
+#define GYRO_SAMPLES 6000 // 60 s
+
+static double true_heading(long i)
+{
+  double t = i * ENCODER_PERIOD;
+  return t < 3.0 ? 0.0 : (t - 3.0) * 10.0;
+}
+
+static double angle_diff(double a, double b)
+{
+  double d = fmod(a - b, 2.0 * M_PI);
+  if (d > M_PI) d -= 2.0 * M_PI;
+  if (d < -M_PI) d += 2.0 * M_PI;
+  return d;
+}
+
+class GyroFusion : public testing::Test
+{
+  protected:
+    virtual void SetUp()
+    {
+      filename_ = board_log_tempfile();
+    }
+
+    virtual void TearDown()
+    {
+      unlink(filename_.c_str());
+    }
+
+    // replays the log with both gyros fused, returns the disagreements
+    unsigned long replay()
+    {
+      CANConfig config;
+      config.backend = CAN_BACKEND_REPLAY;
+      config.replay_file = filename_;
+      config.replay_speed = 0.0;
+      Kurt kurt(comm_, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION,
+          KURT_TICKS_PER_TURN, config);
+      kurt.setGyroFusion(true);
+      while (kurt.can_read_fifo_batch(false) >= 0) ;
+      CANStats stats;
+      kurt.snapshot_stats(&stats);
+      return stats.gyro_disagreements;
+    }
+
+    std::string filename_;
+    TestComm comm_;
+};
+
+TEST_F(GyroFusion, OncePerPair)
+{
+  BoardLog log;
+  ASSERT_TRUE(log.open(filename_.c_str()));
+  for (long i = 0; i < GYRO_SAMPLES; i++)
+  {
+    double stamp = 1.5e9 + i * ENCODER_PERIOD;
+    log.gyro(CAN_GYRO_MC1, true_heading(i), stamp);
+    log.gyro(CAN_GYRO_MC2, true_heading(i), stamp + 0.004);
+  }
+  ASSERT_TRUE(log.close());
+
+  EXPECT_EQ(0u, replay());
+  // both gyros skip their first 100 samples, then one heading per pair
+  EXPECT_EQ((size_t)(GYRO_SAMPLES - 100), comm_.gyro.size());
+  EXPECT_LT(fabs(angle_diff(comm_.gyro.back().theta, true_heading(GYRO_SAMPLES - 1) * M_PI / 180.0)), 0.001);
+}
+
+// the 2nd gyro jumps by 20 deg once and drifts 1 deg/min: one disagreement,
+// then the fusion goes on
+TEST_F(GyroFusion, RecoversAfterDisagreement)
+{
+  BoardLog log;
+  ASSERT_TRUE(log.open(filename_.c_str()));
+  for (long i = 0; i < GYRO_SAMPLES; i++)
+  {
+    double stamp = 1.5e9 + i * ENCODER_PERIOD;
+    double t = i * ENCODER_PERIOD;
+    double error2 = t / 60.0 + (t >= 20.0 ? 20.0 : 0.0);
+    log.gyro(CAN_GYRO_MC1, true_heading(i), stamp);
+    log.gyro(CAN_GYRO_MC2, true_heading(i) + error2, stamp + 0.004);
+  }
+  ASSERT_TRUE(log.close());
+
+  EXPECT_EQ(1u, replay());
+  ASSERT_EQ((size_t)(GYRO_SAMPLES - 100), comm_.gyro.size());
+  // fused again: lower sigma than a single gyro
+  const TestComm::Heading &last = comm_.gyro.back();
+  double single = pow(sqrt(0.01) * M_PI / 180.0, 2);
+  EXPECT_LT(last.sigma, 0.75 * single);
+  // the jump is left out, the drift goes in with half its weight
+  double expected = true_heading(GYRO_SAMPLES - 1) + 0.5 * (GYRO_SAMPLES - 1) * ENCODER_PERIOD / 60.0;
+  EXPECT_LT(fabs(angle_diff(last.theta, expected * M_PI / 180.0)), 0.01);
+}
+
+// the 2nd gyro stops after 30 s, the 1st drives the heading alone
+TEST_F(GyroFusion, SilentGyro)
+{
+  BoardLog log;
+  ASSERT_TRUE(log.open(filename_.c_str()));
+  for (long i = 0; i < GYRO_SAMPLES; i++)
+  {
+    double stamp = 1.5e9 + i * ENCODER_PERIOD;
+    log.gyro(CAN_GYRO_MC1, true_heading(i), stamp);
+    if (i < GYRO_SAMPLES / 2)
+      log.gyro(CAN_GYRO_MC2, true_heading(i), stamp + 0.004);
+  }
+  ASSERT_TRUE(log.close());
+
+  EXPECT_EQ(0u, replay());
+  // the samples within GYRO_FRESH after the last of the 2nd gyro wait for it
+  EXPECT_GE(comm_.gyro.size(), (size_t)(GYRO_SAMPLES - 100 - GYRO_FRESH / ENCODER_PERIOD - 1));
+  EXPECT_LT(fabs(angle_diff(comm_.gyro.back().theta, true_heading(GYRO_SAMPLES - 1) * M_PI / 180.0)), 0.001);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
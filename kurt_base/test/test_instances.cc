@@ -0,0 +1,127 @@
+#include <cmath>
+#include <string>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "board_log.h"
+#include "kurt.h"
+#include "test_comm.h"
+
+// several Kurt objects in one process, each on the replay backend; they
+// share nothing but the log they read
+
+#define SESSION_CYCLES 30000 // 5 min
+
+class Instances : public testing::Test
+{
+  protected:
+    virtual void SetUp()
+    {
+      filename_ = board_log_tempfile();
+      BoardLog log;
+      ASSERT_TRUE(log.session(filename_.c_str(), SESSION_CYCLES));
+    }
+
+    virtual void TearDown()
+    {
+      unlink(filename_.c_str());
+    }
+
+    CANConfig config() const
+    {
+      CANConfig config;
+      config.backend = CAN_BACKEND_REPLAY;
+      config.replay_file = filename_;
+      config.replay_speed = 0.0;
+      return config;
+    }
+
+    std::string filename_;
+};
+
+static void expect_same(const TestComm &a, const TestComm &b)
+{
+  ASSERT_EQ(a.odometry.size(), b.odometry.size());
+  for (size_t i = 0; i < a.odometry.size(); i++)
+  {
+    const TestComm::Pose &p = a.odometry[i], &q = b.odometry[i];
+    ASSERT_EQ(p.stamp, q.stamp) << "sample " << i;
+    ASSERT_EQ(p.z, q.z) << "sample " << i;
+    ASSERT_EQ(p.x, q.x) << "sample " << i;
+    ASSERT_EQ(p.theta, q.theta) << "sample " << i;
+    ASSERT_EQ(p.wheel_a, q.wheel_a) << "sample " << i;
+    ASSERT_EQ(p.wheel_b, q.wheel_b) << "sample " << i;
+  }
+  ASSERT_EQ(a.gyro.size(), b.gyro.size());
+  for (size_t i = 0; i < a.gyro.size(); i++)
+    ASSERT_EQ(a.gyro[i].theta, b.gyro[i].theta) << "sample " << i;
+}
+
+// two instances read the same log batch by batch in turns
+TEST_F(Instances, SideBySide)
+{
+  TestComm comm_a, comm_b;
+  Kurt a(comm_a, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION, KURT_TICKS_PER_TURN, config());
+  Kurt b(comm_b, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION, KURT_TICKS_PER_TURN, config());
+
+  bool done_a = false, done_b = false;
+  while (!done_a || !done_b)
+  {
+    if (!done_a)
+      done_a = a.can_read_fifo_batch(false) < 0;
+    if (!done_b)
+      done_b = b.can_read_fifo_batch(false) < 0;
+  }
+
+  ASSERT_EQ((size_t)SESSION_CYCLES, comm_a.odometry.size());
+  expect_same(comm_a, comm_b);
+}
+
+// fresh instances created one after the other rebuild the same odometry
+TEST_F(Instances, Fresh)
+{
+  TestComm first;
+  for (int i = 0; i < 3; i++)
+  {
+    TestComm comm;
+    {
+      Kurt kurt(comm, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION, KURT_TICKS_PER_TURN, config());
+      while (kurt.can_read_fifo_batch(false) >= 0) ;
+    }
+    if (i == 0)
+      first = comm;
+    else
+      expect_same(first, comm);
+  }
+}
+
+// reset() starts the pose over from zero and reaches the Comm
+TEST_F(Instances, Reset)
+{
+  TestComm comm;
+  Kurt kurt(comm, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION, KURT_TICKS_PER_TURN, config());
+  EXPECT_EQ(1, comm.resets);
+
+  while (comm.odometry.size() < SESSION_CYCLES / 2 && kurt.can_read_fifo_batch(false) >= 0) ;
+  const TestComm::Pose before = comm.odometry.back();
+  ASSERT_GT(hypot(before.x, before.z), 1.0);
+
+  kurt.reset();
+  EXPECT_EQ(2, comm.resets);
+  size_t start = comm.odometry.size();
+  while (comm.odometry.size() == start && kurt.can_read_fifo_batch(false) >= 0) ;
+  ASSERT_GT(comm.odometry.size(), start);
+
+  // one board cycle covers at most a few mm
+  const TestComm::Pose &after = comm.odometry[start];
+  EXPECT_LT(hypot(after.x, after.z), 0.01);
+  EXPECT_LT(fabs(after.theta), 0.01);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "kurt.h"
+#include "test_comm.h"
+#include "vcan.h"
+
+// change driven CAN_CONTROL in micro controller mode against kurt_emulator
+// (KURT_EMULATOR, the path of the built binary) on vcan0: the bus load of a
+// constant setpoint with and without keepalive, and that the watchdog of
+// the board still stops the motors when the frames stop
+
+#define KEEPALIVE_SPEED 0.2 // [m/s] setpoint of both wheels
+
+struct Bus
+{
+  std::vector<double> controls; // stamps of the CAN_CONTROL frames
+  std::vector<int> ticks;       // ticks of both wheels per CAN_ENCODER frame
+};
+
+static int be16(const __u8 *data)
+{
+  return (int16_t)((data[0] << 8) | data[1]);
+}
+
+// the control loop of the driver for seconds s, without control updates if
+// kurt is NULL
+static void run(Kurt *kurt, int s, double seconds, Bus *bus)
+{
+  timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  double end = test_monotonic_now() + seconds;
+  while (test_monotonic_now() < end)
+  {
+    if (kurt != NULL)
+      kurt->set_wheel_speed(KEEPALIVE_SPEED, KEEPALIVE_SPEED, 1.0, test_monotonic_now());
+
+    next.tv_nsec += (long)(CONTROL_PERIOD * 1e9);
+    if (next.tv_nsec >= 1000000000)
+    {
+      next.tv_nsec -= 1000000000;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    can_frame frame;
+    double stamp;
+    while (vcan_read(s, &frame, &stamp, 0.0))
+    {
+      if (frame.can_id == CAN_CONTROL)
+        bus->controls.push_back(stamp);
+      else
+        bus->ticks.push_back(abs(be16(&frame.data[0])) + abs(be16(&frame.data[2])));
+    }
+  }
+}
+
+static double longest_gap(const std::vector<double> &stamps)
+{
+  double gap = 0.0;
+  for (size_t i = 1; i < stamps.size(); i++)
+    gap = std::max(gap, stamps[i] - stamps[i - 1]);
+  return gap;
+}
+
+TEST(Keepalive, EmulatedBoard)
+{
+  if (!vcan_available())
+    return;
+
+  // the emulator with its report on stdout through a pipe
+  int report[2];
+  ASSERT_EQ(0, pipe(report));
+  pid_t emulator = fork();
+  ASSERT_GE(emulator, 0);
+  if (emulator == 0)
+  {
+    dup2(report[1], STDOUT_FILENO);
+    close(report[0]);
+    close(report[1]);
+    execl(KURT_EMULATOR, "kurt_emulator", "-i", VCAN_INTERFACE, (char *)NULL);
+    _exit(127);
+  }
+  close(report[1]);
+
+  int s = vcan_open();
+  ASSERT_GE(s, 0);
+  canid_t ids[2] = { CAN_ENCODER, CAN_CONTROL };
+  vcan_filter(s, ids, 2);
+
+  can_frame frame;
+  double stamp;
+  bool board = vcan_read(s, &frame, &stamp, 2.0);
+
+  TestComm comm;
+  CANConfig config;
+  config.interface = VCAN_INTERFACE;
+  Kurt kurt(comm, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION, KURT_TICKS_PER_TURN, config);
+
+  // a frame every control tick, as before change driven sending
+  Bus every_tick;
+  kurt.setControlKeepalive(CONTROL_PERIOD);
+  run(&kurt, s, 3.0, &every_tick);
+
+  // the same setpoint, repeated only as keepalive
+  Bus keepalive;
+  kurt.setControlKeepalive(CONTROL_KEEPALIVE);
+  run(&kurt, s, 3.0, &keepalive);
+
+  // no more control updates, the board watchdog stops the motors
+  Bus stopped;
+  run(NULL, s, 2.0, &stopped);
+
+  close(s);
+  kill(emulator, SIGTERM);
+  int status;
+  waitpid(emulator, &status, 0);
+  char output[512];
+  ssize_t len = read(report[0], output, sizeof(output) - 1);
+  close(report[0]);
+  output[std::max((ssize_t)0, len)] = '\0';
+
+  ASSERT_TRUE(board) << "no frames from " << KURT_EMULATOR;
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << output;
+
+  double rate_every_tick = every_tick.controls.size() / 3.0;
+  double rate_keepalive = keepalive.controls.size() / 3.0;
+  printf("CAN_CONTROL per s: every tick %.1f keepalive %.1f, longest gap %.1f ms\n",
+      rate_every_tick, rate_keepalive, longest_gap(keepalive.controls) * 1000.0);
+  printf("kurt_emulator: %s", output);
+
+  EXPECT_NEAR(1.0 / CONTROL_PERIOD, rate_every_tick, 0.15 / CONTROL_PERIOD);
+  EXPECT_NEAR(1.0 / CONTROL_KEEPALIVE, rate_keepalive, 0.15 / CONTROL_KEEPALIVE);
+  EXPECT_LT(longest_gap(keepalive.controls), CONTROL_WATCHDOG);
+
+  // with keepalive the wheels keep turning in every board cycle of the
+  // last second
+  ASSERT_GT(keepalive.ticks.size(), 100u);
+  for (size_t i = keepalive.ticks.size() - 100; i < keepalive.ticks.size(); i++)
+    EXPECT_GT(keepalive.ticks[i], 0) << "encoder frame " << i;
+
+  // stopped by the watchdog: no CAN_CONTROL, and after 1 s the wheels stand
+  EXPECT_EQ(0u, stopped.controls.size());
+  ASSERT_GT(stopped.ticks.size(), 150u);
+  for (size_t i = 100; i < stopped.ticks.size(); i++)
+    EXPECT_EQ(0, stopped.ticks[i]) << "encoder frame " << i;
+
+  // exactly the one stop after the frames stopped
+  unsigned long watchdog_stops = 0;
+  const char *p = strstr(output, "watchdog stops:");
+  ASSERT_TRUE(p != NULL) << output;
+  ASSERT_EQ(1, sscanf(p, "watchdog stops: %lu", &watchdog_stops));
+  EXPECT_EQ(1u, watchdog_stops);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,97 @@
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "normalize.h"
+
+// the formulas of Kurt::normalize_ir() and Kurt::normalize_sonar() before
+// the tables, as they were
+static int formula_ir(int ir)
+{
+  if (ir < IR_MIN * 1000 || ir > IR_MAX * 1000) // convert m --> mm
+  {
+    return -1;
+  }
+  return (int)(pow(30000.0 / ((double)ir - 10.0), 1.0 / 1.4) - 10.0);
+}
+
+static int formula_sonar(int s)
+{
+  if (s < SONAR_MIN * 1000 || s > SONAR_MAX * 1000) // convert m --> mm
+  {
+    return -1;
+  }
+  return (int)((double)s * 0.110652 + 11.9231);
+}
+
+static const SensorTables tables;
+
+// every value a 16 bit ADC field can carry
+TEST(Normalize, IrEqualsFormula)
+{
+  for (int raw = 0; raw <= 0xFFFF; raw++)
+    ASSERT_EQ(formula_ir(raw), tables.ir(raw)) << "raw " << raw;
+}
+
+TEST(Normalize, SonarEqualsFormula)
+{
+  for (int raw = 0; raw <= 0xFFFF; raw++)
+    ASSERT_EQ(formula_sonar(raw), tables.sonar(raw)) << "raw " << raw;
+}
+
+TEST(Normalize, RangeEdges)
+{
+  // the first and last valid raw values and their neighbours
+  EXPECT_EQ(100, IR_RAW_MIN);
+  EXPECT_EQ(800, IR_RAW_MAX);
+  EXPECT_EQ(-1, tables.ir(99));
+  EXPECT_NE(-1, tables.ir(100));
+  EXPECT_EQ(formula_ir(100), tables.ir(100));
+  EXPECT_NE(-1, tables.ir(800));
+  EXPECT_EQ(formula_ir(800), tables.ir(800));
+  EXPECT_EQ(-1, tables.ir(801));
+
+  EXPECT_EQ(-1, tables.sonar(99));
+  EXPECT_EQ(formula_sonar(100), tables.sonar(100));
+  EXPECT_EQ(formula_sonar(1000), tables.sonar(1000));
+  EXPECT_EQ(-1, tables.sonar(1001));
+
+  EXPECT_EQ(-1, tables.ir(-1));
+  EXPECT_EQ(-1, tables.sonar(-1));
+}
+
+// the batched path in the channel order of CAN_ADC04_07, every raw value in
+// every lane
+TEST(Normalize, FrameEqualsFormula)
+{
+  static const SensorChannel channels[4] = { SENSOR_IR, SENSOR_SONAR, SENSOR_IR, SENSOR_IR };
+  for (int raw = 0; raw <= 0xFFFF; raw++)
+  {
+    int64_t v[4] = { raw, raw, (raw + 7) & 0xFFFF, (raw * 13) & 0xFFFF };
+    int out[4];
+    tables.normalize_frame(v, channels, 4, out);
+    ASSERT_EQ(formula_ir(v[0]), out[0]) << "raw " << raw;
+    ASSERT_EQ(formula_sonar(v[1]), out[1]) << "raw " << raw;
+    ASSERT_EQ(formula_ir(v[2]), out[2]) << "raw " << v[2];
+    ASSERT_EQ(formula_ir(v[3]), out[3]) << "raw " << v[3];
+  }
+}
+
+// fewer channels than lanes, as in CAN_ADC00_03, must not write past nr
+TEST(Normalize, FramePartial)
+{
+  static const SensorChannel channels[3] = { SENSOR_IR, SENSOR_IR, SENSOR_IR };
+  int64_t v[3] = { 100, 800, 801 };
+  int out[4] = { 0, 0, 0, 12345 };
+  tables.normalize_frame(v, channels, 3, out);
+  EXPECT_EQ(formula_ir(100), out[0]);
+  EXPECT_EQ(formula_ir(800), out[1]);
+  EXPECT_EQ(-1, out[2]);
+  EXPECT_EQ(12345, out[3]);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,87 @@
+#include <string>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "board_log.h"
+#include "kurt.h"
+#include "test_comm.h"
+
+// the receive filter follows the rotunit commands: CAN_GETROTUNIT only
+// passes while the rotunit turns. Replayed session with an encoder and a
+// rotunit frame every board cycle.
+
+#define ROTUNIT_CYCLES 3000 // 30 s
+
+class Rotunit : public testing::Test
+{
+  protected:
+    virtual void SetUp()
+    {
+      filename_ = board_log_tempfile();
+      BoardLog log;
+      ASSERT_TRUE(log.open(filename_.c_str()));
+      for (long c = 0; c < ROTUNIT_CYCLES; c++)
+      {
+        double stamp = 1.5e9 + c * ENCODER_PERIOD;
+        uint8_t data[4];
+        BoardLog::put(data, 0, 2, 100);
+        BoardLog::put(data, 2, 2, 100);
+        log.write(CAN_ENCODER, data, 4, stamp);
+        BoardLog::put(data, 0, 1, 0);
+        BoardLog::put(data, 1, 2, (c * 17) % 10240);
+        log.write(CAN_GETROTUNIT, data, 3, stamp + 0.0002);
+      }
+      ASSERT_TRUE(log.close());
+    }
+
+    virtual void TearDown()
+    {
+      unlink(filename_.c_str());
+    }
+
+    // reads until cycles more encoder frames were decoded, returns the
+    // rotunit samples in between
+    unsigned long read(Kurt &kurt, size_t cycles)
+    {
+      unsigned long rotunits = comm_.rotunits;
+      size_t end = comm_.odometry.size() + cycles;
+      while (comm_.odometry.size() < end && kurt.can_read_fifo_batch(false) >= 0) ;
+      return comm_.rotunits - rotunits;
+    }
+
+    std::string filename_;
+    TestComm comm_;
+};
+
+TEST_F(Rotunit, FilterFollowsCommands)
+{
+  CANConfig config;
+  config.backend = CAN_BACKEND_REPLAY;
+  config.replay_file = filename_;
+  config.replay_speed = 0.0;
+  Kurt kurt(comm_, KURT_WHEEL_PERIMETER, KURT_AXIS_LENGTH, KURT_TURNING_ADAPTATION, KURT_TICKS_PER_TURN, config);
+
+  EXPECT_EQ(0u, read(kurt, 500));
+
+  kurt.can_rotunit_send(M_PI / 6.0);
+  EXPECT_GT(read(kurt, 500), 450u);
+
+  // stopped: filtered out again
+  kurt.can_rotunit_send(0.0);
+  read(kurt, 10); // the rest of the batch read before the stop
+  EXPECT_EQ(0u, read(kurt, 500));
+
+  // a second stop changes nothing, turning again lets them through
+  kurt.can_rotunit_send(0.0);
+  EXPECT_EQ(0u, read(kurt, 500));
+  kurt.can_rotunit_send(-M_PI / 6.0);
+  EXPECT_GT(read(kurt, 500), 450u);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,139 @@
+#ifndef _TEST_VCAN_H_
+#define _TEST_VCAN_H_
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+// helpers for the tests and benchmarks on a virtual CAN interface, set up with
+//   modprobe vcan
+//   ip link add dev vcan0 type vcan
+//   ip link set up vcan0
+#define VCAN_INTERFACE "vcan0"
+
+static inline double test_monotonic_now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline double test_realtime_now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline double test_thread_cpu()
+{
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// raw socket on interface that sees all frames and gets kernel receive time
+// stamps, -1 if the interface does not exist
+static inline int vcan_open(const char *interface = VCAN_INTERFACE)
+{
+  int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (s < 0)
+    return -1;
+  int enable = 1;
+  setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+
+  ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name) - 1);
+  if (ioctl(s, SIOCGIFINDEX, &ifr) < 0)
+  {
+    close(s);
+    return -1;
+  }
+
+  sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(s, (sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+static inline bool vcan_available(const char *interface = VCAN_INTERFACE)
+{
+  int s = vcan_open(interface);
+  if (s < 0)
+  {
+    printf("%s not available, skipped (see test/vcan.h)\n", interface);
+    return false;
+  }
+  close(s);
+  return true;
+}
+
+// reads one frame with a timeout in s, false on timeout; stamp is the
+// kernel receive time (CLOCK_REALTIME)
+static inline bool vcan_read(int s, can_frame *frame, double *stamp, double timeout)
+{
+  timeval tv;
+  tv.tv_sec = (long)timeout;
+  tv.tv_usec = (long)((timeout - tv.tv_sec) * 1e6);
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(s, &rfds);
+  if (select(s + 1, &rfds, NULL, NULL, &tv) <= 0)
+    return false;
+
+  iovec iov;
+  iov.iov_base = frame;
+  iov.iov_len = sizeof(*frame);
+  char control[CMSG_SPACE(sizeof(timespec))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(s, &msg, 0) != sizeof(*frame))
+    return false;
+
+  *stamp = test_realtime_now();
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      *stamp = ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+  }
+  return true;
+}
+
+// only frames with one of the nr IDs
+static inline void vcan_filter(int s, const canid_t *ids, size_t nr)
+{
+  can_filter filter[16];
+  for (size_t i = 0; i < nr && i < 16; i++)
+  {
+    filter[i].can_id = ids[i];
+    filter[i].can_mask = CAN_SFF_MASK;
+  }
+  setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, filter, nr * sizeof(filter[0]));
+}
+
+#endif
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# vcan.setup.sh:
+# Creates a virtual CAN interface for running kurt_base against
+# kurt_emulator without the real board, e.g.:
+#   rosrun kurt_base kurt_emulator -i vcan0 &
+#   rosrun kurt_base kurt_base _can_interface:=vcan0
+
+IFNAME=${1:-vcan0}
+
+sudo modprobe vcan
+sudo ip link add dev ${IFNAME} type vcan
+sudo ip link set up ${IFNAME}